@@ -0,0 +1,321 @@
+// Binary institution -> author index written by run_all_countries
+// (list_all / list_outflow) next to institutions.json and memory-mapped by
+// match_emails, so that the matcher starts without parsing any JSON.
+//
+// Layout (native byte order, every section 8-byte aligned):
+//   header        magic "AAINDX02", the section sizes and year_begin
+//   institutions  IndexInstitution[n], authors [author_begin, author_end)
+//   authors       IndexAuthor[m], grouped by institution (CSR)
+//   alternatives  uint64_t[k] string offsets, [alternative_begin, alternative_end)
+//   heap          NUL-terminated strings, each distinct string stored once
+//                 (unless the builder was memory-bounded, see below)
+// All names are stored lowercased, as the matcher compares them.  Each
+// author entry has the years of the affiliation as bits, bit y standing
+// for year_begin + y; no bits means the years are unknown.
+#ifndef INSTITUTION_INDEX_H
+#define INSTITUTION_INDEX_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char const INSTITUTION_INDEX_MAGIC[] = "AAINDX02";
+int64_t constexpr INDEX_YEAR_BEGIN = 1990;     // default of the builder
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t institutions;
+    uint64_t authors;
+    uint64_t alternatives;
+    uint64_t heap;          // bytes
+    int64_t year_begin;
+};
+
+struct IndexInstitution {
+    int64_t id;
+    uint64_t name;          // offset into the heap
+    uint64_t author_begin;
+    uint64_t author_end;
+};
+
+struct IndexAuthor {
+    int64_t id;
+    uint64_t name;
+    uint64_t alternative_begin;
+    uint64_t alternative_end;
+    uint64_t years;
+};
+
+// One section of an index being built.  Appended in memory; once given
+// a spill file, the buffer is moved out to it whenever it reaches the
+// limit, and the section is replayed from the file and the buffer.
+class IndexSection {
+    std::string buffer;
+    std::string path;
+    std::ofstream spill;
+    size_t limit = 0;
+    uint64_t bytes = 0;
+
+    void flush () {
+        if (!spill.is_open()) {
+            spill.open(path, std::ios::binary);
+            if (!spill) throw std::runtime_error("cannot write " + path);
+        }
+        spill.write(buffer.data(), buffer.size());
+        if (!spill) throw std::runtime_error("failed to write " + path);
+        buffer.clear();
+    }
+
+public:
+    IndexSection () {}
+    IndexSection (IndexSection const &) = delete;
+    IndexSection &operator = (IndexSection const &) = delete;
+
+    ~IndexSection () {
+        if (spill.is_open()) {
+            spill.close();
+            std::remove(path.c_str());
+        }
+    }
+
+    void spill_to (std::string const &path_, size_t limit_) {
+        path = path_;
+        limit = limit_;
+    }
+
+    uint64_t size () const { return bytes; }
+
+    void append (void const *p, size_t n) {
+        buffer.append(static_cast<char const *>(p), n);
+        bytes += n;
+        if (limit > 0 && buffer.size() >= limit) flush();
+    }
+
+    template <typename Put>
+    void replay (Put const &put) {
+        if (spill.is_open()) {
+            spill.flush();
+            std::ifstream is(path, std::ios::binary);
+            std::vector<char> chunk(1 << 20);
+            for (;;) {
+                is.read(chunk.data(), chunk.size());
+                if (is.gcount() == 0) break;
+                put(chunk.data(), size_t(is.gcount()));
+            }
+            if (is.bad()) throw std::runtime_error("failed to read " + path);
+        }
+        put(buffer.data(), buffer.size());
+    }
+};
+
+// Builds the index institution by institution: add_institution, then the
+// add_author calls of its authors.  By default everything is held in
+// memory.  Given a spill prefix and a budget, the sections are spilled to
+// <prefix>.<section> files as they grow, and the table that stores each
+// distinct string once is reset when it outgrows its share of the budget,
+// so a string may then be stored more than once.
+class InstitutionIndexBuilder {
+    int64_t year_begin;
+    IndexSection institutions;
+    IndexSection authors;
+    IndexSection alternatives;
+    IndexSection heap;
+    IndexInstitution current;       // the institution still taking authors
+    bool has_current = false;
+    uint64_t author_count = 0;
+    uint64_t alternative_count = 0;
+    uint64_t institution_count = 0;
+    std::unordered_map<std::string, uint64_t> offsets;
+    size_t offsets_limit = 0;       // bytes, 0 for unbounded
+    size_t offsets_bytes = 0;
+
+    uint64_t intern (std::string_view str) {
+        std::string lower(str);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        auto it = offsets.find(lower);
+        if (it != offsets.end()) return it->second;
+        uint64_t off = heap.size();
+        heap.append(lower.c_str(), lower.size() + 1);
+        if (offsets_limit > 0) {
+            // the string, its node and its bucket, roughly
+            offsets_bytes += lower.size() + 64;
+            if (offsets_bytes > offsets_limit) {
+                offsets.clear();
+                offsets_bytes = 0;
+            }
+        }
+        offsets.emplace(std::move(lower), off);
+        return off;
+    }
+
+    void close_institution () {
+        if (!has_current) return;
+        institutions.append(&current, sizeof(current));
+        has_current = false;
+    }
+
+public:
+    explicit InstitutionIndexBuilder (int64_t year_begin_ = INDEX_YEAR_BEGIN): year_begin(year_begin_) {}
+
+    // spill the sections to <prefix>.<section> files, keeping about budget
+    // bytes in memory; must be called before anything is added
+    InstitutionIndexBuilder (int64_t year_begin_, std::string const &prefix, size_t budget): year_begin(year_begin_) {
+        institutions.spill_to(prefix + ".institutions", budget / 8);
+        authors.spill_to(prefix + ".authors", budget / 8);
+        alternatives.spill_to(prefix + ".alternatives", budget / 8);
+        heap.spill_to(prefix + ".heap", budget / 8);
+        offsets_limit = budget / 2;
+    }
+
+    // bit of a year, 0 if outside the 64 years from year_begin
+    uint64_t year_bit (int64_t year) const {
+        return (year >= year_begin && year < year_begin + 64) ? uint64_t(1) << (year - year_begin) : 0;
+    }
+
+    void add_institution (int64_t id, std::string_view name) {
+        close_institution();
+        current = {id, intern(name), author_count, author_count};
+        has_current = true;
+        ++institution_count;
+    }
+
+    // alternative_names: any range of strings or string_views
+    template <typename Names>
+    void add_author (int64_t id, std::string_view name, Names const &alternative_names, uint64_t years) {
+        uint64_t begin = alternative_count;
+        for (auto const &alt: alternative_names) {
+            uint64_t off = intern(alt);
+            alternatives.append(&off, sizeof(off));
+            ++alternative_count;
+        }
+        IndexAuthor author{id, intern(name), begin, alternative_count, years};
+        authors.append(&author, sizeof(author));
+        current.author_end = ++author_count;
+    }
+
+    size_t size () const { return institution_count; }
+
+    // Pass the header and then each section to put(char const *, size_t),
+    // in file order, without assembling the whole index first.
+    template <typename Put>
+    void serialize (Put const &put) {
+        close_institution();
+        IndexHeader header;
+        std::memcpy(header.magic, INSTITUTION_INDEX_MAGIC, 8);
+        header.institutions = institution_count;
+        header.authors = author_count;
+        header.alternatives = alternative_count;
+        header.heap = heap.size();
+        header.year_begin = year_begin;
+        put(reinterpret_cast<char const *>(&header), sizeof(header));
+        institutions.replay(put);
+        authors.replay(put);
+        alternatives.replay(put);
+        heap.replay(put);
+    }
+
+    // the serialized index
+    std::string data () {
+        std::string out;
+        serialize([&out](char const *p, size_t n) { out.append(p, n); });
+        return out;
+    }
+
+    // written to path.tmp section by section, then renamed into place
+    void save (std::string const &path) {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream os(tmp, std::ios::binary);
+            serialize([&os](char const *p, size_t n) { os.write(p, n); });
+            os.close();
+            if (!os) throw std::runtime_error("failed to write " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("cannot rename " + tmp + " to " + path);
+        }
+    }
+};
+
+// Read-only view of an index, memory-mapped from a file or over a buffer
+// made by InstitutionIndexBuilder::data.
+class InstitutionIndex {
+    void *base = MAP_FAILED;
+    size_t length = 0;
+    std::string buffer;
+    IndexHeader const *header;
+    IndexInstitution const *institutions;
+    IndexAuthor const *authors;
+    uint64_t const *alternatives;
+    char const *heap;
+
+    void attach (char const *p, size_t size) {
+        header = reinterpret_cast<IndexHeader const *>(p);
+        if (size < sizeof(IndexHeader) || std::memcmp(header->magic, INSTITUTION_INDEX_MAGIC, 8) != 0) {
+            throw std::runtime_error("not an institution index");
+        }
+        institutions = reinterpret_cast<IndexInstitution const *>(p + sizeof(IndexHeader));
+        authors = reinterpret_cast<IndexAuthor const *>(institutions + header->institutions);
+        alternatives = reinterpret_cast<uint64_t const *>(authors + header->authors);
+        heap = reinterpret_cast<char const *>(alternatives + header->alternatives);
+        if (size_t(heap + header->heap - p) != size) {
+            throw std::runtime_error("truncated institution index");
+        }
+    }
+
+public:
+    explicit InstitutionIndex (std::string const &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        fstat(fd, &st);
+        length = st.st_size;
+        base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+        attach(static_cast<char const *>(base), length);
+    }
+
+    explicit InstitutionIndex (std::string &&data): buffer(std::move(data)) {
+        attach(buffer.data(), buffer.size());
+    }
+
+    ~InstitutionIndex () {
+        if (base != MAP_FAILED) munmap(base, length);
+    }
+
+    InstitutionIndex (InstitutionIndex const &) = delete;
+    InstitutionIndex &operator = (InstitutionIndex const &) = delete;
+
+    size_t size () const { return header->institutions; }
+    size_t author_count () const { return header->authors; }
+    int64_t year_begin () const { return header->year_begin; }
+
+    // bits of the years [from, to], clipped to the 64 years of the index
+    uint64_t year_window (int64_t from, int64_t to) const {
+        uint64_t bits = 0;
+        for (int64_t year = std::max(from, year_begin()); year <= to && year < year_begin() + 64; ++year) {
+            bits |= uint64_t(1) << (year - year_begin());
+        }
+        return bits;
+    }
+
+    IndexInstitution const &institution (size_t i) const { return institutions[i]; }
+    IndexAuthor const &author (size_t a) const { return authors[a]; }
+    std::string_view string (uint64_t offset) const { return heap + offset; }
+    std::string_view alternative (uint64_t k) const { return string(alternatives[k]); }
+    uint64_t alternative_offset (uint64_t k) const { return alternatives[k]; }
+};
+
+#endif
@@ -4,13 +4,22 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <memory>
 #include <algorithm>
+#include <cctype>       // for std::isdigit
 #include <cstdlib>      // for std::exit
 #include <iomanip>      // for std::setprecision
 
 // Include nlohmann's JSON library (you need to have the header available)
 #include <nlohmann/json.hpp>
+#define BXZSTR_CONFIG_HPP
+#define BXZSTR_Z_SUPPORT 1
+#define BXZSTR_BZ2_SUPPORT 0
+#define BXZSTR_LZMA_SUPPORT 0
+#define BXZSTR_ZSTD_SUPPORT 0
+#include <bxzstr.hpp>     // reads institutions.json.gz as well
 #include "match.h"      // Your matching interface and implementations
+#include "institution_index.h"
 
 // For convenience
 using json = nlohmann::json;
@@ -26,18 +35,6 @@ struct CsvRow {
     double amount;
 };
 
-struct JsonAuthor {
-    int64_t id;           // e.g., "123"
-    std::string displayName;   // e.g., "John Doe"
-    std::vector<std::string> alternative_names;
-};
-
-struct JsonInstitution {
-    int64_t id;           // e.g., "inst-001"
-    std::string displayName;  // e.g., "Massachusetts Institute of Technology"
-    std::vector<JsonAuthor> authors;
-};
-
 // -----------------------------------------------------------------------------
 // Naive CSV parser (just for demonstration)
 // -----------------------------------------------------------------------------
@@ -118,10 +115,12 @@ std::vector<CsvRow> loadCsv(const std::string &csvPath)
 // -----------------------------------------------------------------------------
 // Load JSON file: expects a list of JSON objects, each with "id", "display_name",
 // and "authors" (an array of { "id":..., "display_name":... }).
+// The institutions are converted into an in-memory InstitutionIndex, the
+// same structure that is memory-mapped from institutions.idx.
 // -----------------------------------------------------------------------------
-void loadJsonInstitutions(const std::string &jsonPath, std::vector<JsonInstitution> *ptr)
+std::string loadJsonInstitutions(const std::string &jsonPath)
 {
-    std::ifstream in(jsonPath);
+    bxz::ifstream in(jsonPath);
     if (!in.is_open()) {
         std::cerr << "Error: cannot open JSON file: " << jsonPath << std::endl;
         std::exit(1);
@@ -153,64 +152,64 @@ void loadJsonInstitutions(const std::string &jsonPath, std::vector<JsonInstituti
         std::exit(1);
     }
 
-    std::vector<JsonInstitution> institutions;
-    int author_count = 0;
+    // the builder lowercases all names
+    InstitutionIndexBuilder builder;
     for (auto &elem : j) {
-        JsonInstitution inst;
         // Safely extract fields
-        //std::cout << "Processing institution:"  << elem << std::endl;
-        inst.id = strtoll(elem["id"].get<std::string>().c_str(), nullptr, 10);
-        inst.displayName = elem.value("display_name", "");
-        std::transform(inst.displayName.begin(), inst.displayName.end(), inst.displayName.begin(), ::tolower);
+        int64_t id = strtoll(elem["id"].get<std::string>().c_str(), nullptr, 10);
+        builder.add_institution(id, elem.value("display_name", ""));
         if (elem.contains("authors") && elem["authors"].is_array()) {
             for (auto &auth : elem["authors"]) {
-                JsonAuthor ja;
-                ja.id = strtoll(auth["id"].get<std::string>().c_str(), nullptr, 10);
-                ja.displayName = auth.value("display_name", "");
-                std::transform(ja.displayName.begin(), ja.displayName.end(), ja.displayName.begin(), ::tolower);
-
+                int64_t author_id = strtoll(auth["id"].get<std::string>().c_str(), nullptr, 10);
+                std::vector<std::string> alternative_names;
                 if (auth.contains("display_name_alternatives")) {
                     for (auto const &name : auth["display_name_alternatives"]) {
-                        std::string lower_name = name;
-                        std::transform(lower_name.begin(), lower_name.end(), lower_name.begin(), ::tolower);
-                        ja.alternative_names.push_back(lower_name);
+                        alternative_names.push_back(name);
                     }
                 }
-                
-                inst.authors.push_back(ja);
-                author_count++;
+                uint64_t years = 0;
+                if (auth.contains("years")) {
+                    for (auto const &year : auth["years"]) {
+                        years |= builder.year_bit(year.get<int64_t>());
+                    }
+                }
+                builder.add_author(author_id, auth.value("display_name", ""), alternative_names, years);
             }
         }
-        institutions.push_back(std::move(inst));
     }
-    std::cout << "Number of JSON institutions loaded: " << institutions.size() << "\n";
-    std::cout << "Number of JSON authors loaded: " << author_count << "\n";
+    return builder.data();
+}
+
+void describeInstitutions(const InstitutionIndex &index)
+{
+    std::cout << "Number of JSON institutions loaded: " << index.size() << "\n";
+    std::cout << "Number of JSON authors loaded: " << index.author_count() << "\n";
     std::cout << "\nFirst 5 institutions:\n";
-    for (size_t i = 0; i < std::min(size_t(5), institutions.size()); ++i) {
+    for (size_t i = 0; i < std::min(size_t(5), index.size()); ++i) {
+        auto const &inst = index.institution(i);
         std::cout << "Institution " << i+1 << ":\n";
-        std::cout << "  ID: " << institutions[i].id << "\n";
-        std::cout << "  Name: " << institutions[i].displayName << "\n";
-        std::cout << "  Number of authors: " << institutions[i].authors.size() << "\n";
+        std::cout << "  ID: " << inst.id << "\n";
+        std::cout << "  Name: " << index.string(inst.name) << "\n";
+        std::cout << "  Number of authors: " << inst.author_end - inst.author_begin << "\n";
     }
     std::cout << "\n";
-    ptr->swap(institutions);
 }
 
 // -----------------------------------------------------------------------------
-// Find the best matching institution in JSON by comparing s with inst.displayName
-// Uses the given StringMatcher. Returns (indexInVector, bestRatio).
+// Find the best matching institution in the index by comparing s with its
+// display name.  Uses the given StringMatcher. Returns (institution, bestRatio).
 // If no good match found, returns (size_t(-1), 0.0).
 // -----------------------------------------------------------------------------
 std::pair<size_t,double> bestInstitutionMatch(
     const std::string &s,
-    const std::vector<JsonInstitution> &jsonInsts,
+    const InstitutionIndex &index,
     const StringMatcher &matcher)
 {
     size_t bestIdx = size_t(-1);
     double bestRatio = 0.0;
 
-    for (size_t i = 0; i < jsonInsts.size(); ++i) {
-        double r = matcher.match(s, jsonInsts[i].displayName);
+    for (size_t i = 0; i < index.size(); ++i) {
+        double r = matcher.match(s, std::string(index.string(index.institution(i).name)));
         if (r > bestRatio) {
             bestRatio = r;
             bestIdx = i;
@@ -220,29 +219,62 @@ std::pair<size_t,double> bestInstitutionMatch(
 }
 
 // -----------------------------------------------------------------------------
-// Find the best matching author in a JSON institution by comparing s with
-// each author's displayName. Returns (indexInVector, bestRatio).
+// Authors of an institution that are candidates for matching: with a year
+// window (yearBits != 0), only those affiliated in one of its years, plus
+// those whose years are unknown.
+// -----------------------------------------------------------------------------
+std::vector<size_t> candidateAuthors(
+    const InstitutionIndex &index,
+    const IndexInstitution &inst,
+    uint64_t yearBits)
+{
+    std::vector<size_t> candidates;
+    for (size_t a = inst.author_begin; a < inst.author_end; ++a) {
+        uint64_t years = index.author(a).years;
+        if (yearBits == 0 || years == 0 || (years & yearBits)) {
+            candidates.push_back(a);
+        }
+    }
+    return candidates;
+}
+
+// -----------------------------------------------------------------------------
+// Find the best matching author among the candidates by comparing s with
+// each author's displayName and alternatives. Returns (author, bestRatio),
+// the author being an index into the author array of the index.
 // If no good match found, returns (size_t(-1), 0.0).
+// Names are interned in the index heap, so equal names have equal offsets
+// and each distinct name is matched against s only once.
 // -----------------------------------------------------------------------------
 std::pair<size_t,double> bestAuthorMatch(
     const std::string &s,
-    const std::vector<JsonAuthor> &authors,
+    const InstitutionIndex &index,
+    const std::vector<size_t> &candidates,
     const StringMatcher &matcher)
 {
     size_t bestIdx = size_t(-1);
     double bestRatio = 0.0;
 
-    for (size_t i = 0; i < authors.size(); ++i) {
-        double r = matcher.match(s, authors[i].displayName);
-        for (auto const &name: authors[i].alternative_names) {
-            double r2 = matcher.match(s, name);
+    std::unordered_map<uint64_t, double> ratios;   // by heap offset
+    auto ratio = [&](uint64_t offset) {
+        auto it = ratios.find(offset);
+        if (it == ratios.end()) {
+            it = ratios.emplace(offset, matcher.match(s, std::string(index.string(offset)))).first;
+        }
+        return it->second;
+    };
+    for (size_t a: candidates) {
+        auto const &author = index.author(a);
+        double r = ratio(author.name);
+        for (size_t k = author.alternative_begin; k < author.alternative_end; ++k) {
+            double r2 = ratio(index.alternative_offset(k));
             if (r2 > r) {
                 r = r2;
             }
         }
         if (r > bestRatio) {
             bestRatio = r;
-            bestIdx = i;
+            bestIdx = a;
         }
     }
     return {bestIdx, bestRatio};
@@ -253,13 +285,43 @@ std::pair<size_t,double> bestAuthorMatch(
 // -----------------------------------------------------------------------------
 struct CmdArgs {
     std::string jsonFile;
+    std::string indexFile;
     std::string csvFile;
     std::string outFile;
     double instThreshold;
     double nameThreshold;
+    int yearFrom;         // year window of the candidate authors,
+    int yearTo;           // yearFrom > yearTo means no window
     bool useEditDistance; // e.g. user can select which matcher
 };
 
+void printUsage(std::ostream &os, const char *program)
+{
+    os << "Usage: " << program << " [options]\n"
+       << "Options:\n"
+       << "  -j, --json FILE           JSON institutions file (default: data/list/institutions.json)\n"
+       << "  -i, --index FILE          Binary institution index (default: the .idx next to the JSON file, if present)\n"
+       << "  -c, --csv FILE            CSV emails file (default: /home/wdong/crawl/NSF/emails.csv)\n" 
+       << "  -o, --output FILE         Output file (default: matched_authors.csv)\n"
+       << "  --inst_threshold VALUE    Institution matching threshold (default: 0.9)\n"
+       << "  --name_threshold VALUE    Author name matching threshold (default: 0.9)\n"
+       << "  --years FROM-TO           Only match authors affiliated with the institution in these years\n"
+       << "                            (FROM <= TO, or a single year)\n"
+       << "  --edit_distance          Use edit distance matcher instead of Ratcliff/Obershelp\n"
+       << "  -h, --help               Show this help message\n";
+}
+
+// A year of --years: digits only, nothing else
+bool parseYear(const std::string &text, int *year)
+{
+    if (text.empty() || text.size() > 4) return false;
+    for (char c : text) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) return false;
+    }
+    *year = std::stoi(text);
+    return true;
+}
+
 CmdArgs parseArgs(int argc, char** argv)
 {
     CmdArgs args;
@@ -268,6 +330,8 @@ CmdArgs parseArgs(int argc, char** argv)
     args.outFile  = "data/NSF/matched_authors.csv";
     args.instThreshold = 0.85;
     args.nameThreshold = 0.9;
+    args.yearFrom = 1;
+    args.yearTo = 0;
     args.useEditDistance = false;
 
     for (int i = 1; i < argc; ++i) {
@@ -275,6 +339,9 @@ CmdArgs parseArgs(int argc, char** argv)
         if ((opt == "--json" || opt == "-j") && i+1 < argc) {
             args.jsonFile = argv[++i];
         }
+        else if ((opt == "--index" || opt == "-i") && i+1 < argc) {
+            args.indexFile = argv[++i];
+        }
         else if ((opt == "--csv" || opt == "-c") && i+1 < argc) {
             args.csvFile = argv[++i];
         }
@@ -287,19 +354,24 @@ CmdArgs parseArgs(int argc, char** argv)
         else if (opt == "--name_threshold" && i+1 < argc) {
             args.nameThreshold = std::stod(argv[++i]);
         }
+        else if (opt == "--years" && i+1 < argc) {
+            // FROM-TO or a single year
+            std::string window = argv[++i];
+            size_t dash = window.find('-');
+            bool valid = parseYear(window.substr(0, dash), &args.yearFrom);
+            if (dash == std::string::npos) args.yearTo = args.yearFrom;
+            else valid = valid && parseYear(window.substr(dash + 1), &args.yearTo);
+            if (!valid || args.yearFrom > args.yearTo) {
+                std::cerr << "Invalid year window: " << window << std::endl;
+                printUsage(std::cerr, argv[0]);
+                std::exit(1);
+            }
+        }
         else if (opt == "--edit_distance") {
             args.useEditDistance = true;
         }
         else if (opt == "--help" || opt == "-h") {
-            std::cout << "Usage: " << argv[0] << " [options]\n"
-                     << "Options:\n"
-                     << "  -j, --json FILE           JSON institutions file (default: data/list/institutions.json)\n"
-                     << "  -c, --csv FILE            CSV emails file (default: /home/wdong/crawl/NSF/emails.csv)\n" 
-                     << "  -o, --output FILE         Output file (default: matched_authors.csv)\n"
-                     << "  --inst_threshold VALUE    Institution matching threshold (default: 0.9)\n"
-                     << "  --name_threshold VALUE    Author name matching threshold (default: 0.9)\n"
-                     << "  --edit_distance          Use edit distance matcher instead of Ratcliff/Obershelp\n"
-                     << "  -h, --help               Show this help message\n";
+            printUsage(std::cout, argv[0]);
             std::exit(0);
         }
         else {
@@ -307,12 +379,22 @@ CmdArgs parseArgs(int argc, char** argv)
             std::exit(1);
         }
     }
+    if (args.indexFile.empty()) {
+        std::string stem = args.jsonFile;
+        for (std::string ext: {".gz", ".json"}) {
+            if (stem.ends_with(ext)) stem.resize(stem.size() - ext.size());
+        }
+        std::ifstream probe(stem + ".idx");
+        if (probe.is_open()) args.indexFile = stem + ".idx";
+    }
     std::cout << "Command line arguments:\n"
               << "  JSON file: " << args.jsonFile << "\n"
+              << "  Index file: " << (args.indexFile.empty() ? "(none)" : args.indexFile) << "\n"
               << "  CSV file: " << args.csvFile << "\n" 
               << "  Output file: " << args.outFile << "\n"
               << "  Institution threshold: " << args.instThreshold << "\n"
               << "  Name threshold: " << args.nameThreshold << "\n"
+              << "  Years: " << (args.yearFrom <= args.yearTo ? std::to_string(args.yearFrom) + "-" + std::to_string(args.yearTo) : "all") << "\n"
               << "  Using edit distance: " << (args.useEditDistance ? "yes" : "no") << "\n";
     return args;
 }
@@ -326,10 +408,31 @@ int main(int argc, char** argv)
     CmdArgs args = parseArgs(argc, argv);
 
     // 2) Load data
-    std::cout << "Loading JSON from: " << args.jsonFile << std::endl;
-    std::vector<JsonInstitution> jsonInsts;
-    loadJsonInstitutions(args.jsonFile, &jsonInsts);
-    std::cout << "Number of JSON institutions loaded: " << jsonInsts.size() << "\n";
+    // the index is mapped as is; the JSON is converted into the same form
+    std::unique_ptr<InstitutionIndex> indexPtr;
+    try {
+        if (!args.indexFile.empty()) {
+            std::cout << "Mapping index from: " << args.indexFile << std::endl;
+            indexPtr = std::make_unique<InstitutionIndex>(args.indexFile);
+        }
+        else {
+            std::cout << "Loading JSON from: " << args.jsonFile << std::endl;
+            indexPtr = std::make_unique<InstitutionIndex>(loadJsonInstitutions(args.jsonFile));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    const InstitutionIndex &jsonInsts = *indexPtr;
+    describeInstitutions(jsonInsts);
+    uint64_t yearBits = 0;
+    if (args.yearFrom <= args.yearTo) {
+        yearBits = jsonInsts.year_window(args.yearFrom, args.yearTo);
+        if (yearBits == 0) {
+            std::cerr << "Error: the year window is outside the years of the index\n";
+            return 1;
+        }
+    }
 
     std::cout << "Loading CSV from: " << args.csvFile << std::endl;
     auto csvData = loadCsv(args.csvFile);
@@ -406,38 +509,40 @@ int main(int argc, char** argv)
         }
 
         // We have a best JSON institution
-        const auto &bestInst = jsonInsts[bestIdx]; // e.g. "Massachusetts Institute of Technology"
+        const auto &bestInst = jsonInsts.institution(bestIdx); // e.g. "Massachusetts Institute of Technology"
+        std::string bestInstName(jsonInsts.string(bestInst.name));
 
 
         #pragma omp critical
         instMatchedResults.push_back({
             bestInst.id,
-            bestInst.displayName,
+            bestInstName,
             csvInstName,
             instRatio
         });
 
 
         // For each CSV row in this institution, attempt to match the author
+        std::vector<size_t> candidates = candidateAuthors(jsonInsts, bestInst, yearBits);
         for (auto &row : rowsThisInst) {
             // build full name from CSV
             std::string csvFullName = row.firstName + " " + row.lastName;
 
-            auto [bestAuthorIdx, nameRatio] = bestAuthorMatch(csvFullName, bestInst.authors, nameMatcher);
+            auto [bestAuthorIdx, nameRatio] = bestAuthorMatch(csvFullName, jsonInsts, candidates, nameMatcher);
             if (bestAuthorIdx == size_t(-1) || nameRatio < args.nameThreshold) {
                 continue;
             }
 
             // We have a best author
-            const auto &jsonAuth = bestInst.authors[bestAuthorIdx];
+            const auto &jsonAuth = jsonInsts.author(bestAuthorIdx);
             // Store result
             #pragma omp critical
             matchedResults.push_back({
                 jsonAuth.id,
-                jsonAuth.displayName,
+                std::string(jsonInsts.string(jsonAuth.name)),
                 csvFullName,
                 bestInst.id,
-                bestInst.displayName,
+                bestInstName,
                 csvInstName,
                 row.amount,
                 row.email,
@@ -509,10 +614,7 @@ int main(int argc, char** argv)
     // 7) Print a summary
     std::cout << "\nOutput CSV written to: " << args.outFile << "\n";
     std::cout << "===== MATCH SUMMARY =====\n";
-    size_t totalJsonAuthors = 0;
-    for (auto &inst : jsonInsts) {
-        totalJsonAuthors += inst.authors.size();
-    }
+    size_t totalJsonAuthors = jsonInsts.author_count();
     std::cout << "Total JSON institutions: " << jsonInsts.size() << "\n";
     std::cout << "Total JSON authors:      " << totalJsonAuthors << "\n";
     std::cout << "Total CSV rows:         " << csvData.size() << "\n";
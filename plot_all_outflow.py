@@ -3,6 +3,7 @@ import os
 import json
 import numpy as np
 import matplotlib.pylab as plt
+from sparse_tensor import load_counts
 
 LABELS = [
     #'All',
@@ -34,7 +35,7 @@ class Analyze:
         with open(os.path.join(root, 'meta.json'), 'r') as f:
             meta = json.load(f)
         self.meta = meta
-        counts = np.load(os.path.join(root, 'counts.npy'))
+        counts = load_counts(root)
         assert counts.shape[-1] == len(COUNTRIES)
         print(meta)
         print(counts.shape)
@@ -43,17 +44,29 @@ class Analyze:
         begin = year_begin - self.offset    
         end = year_end - self.offset
         self.counts = counts[:, :, begin:end, :]
+        # bootstrap percentile bands, present when run with --bootstrap
+        self.lower = None
+        self.upper = None
+        if 'bootstrap' in meta:
+            self.lower = load_counts(root, 'counts_lower')[:, :, begin:end, :]
+            self.upper = load_counts(root, 'counts_upper')[:, :, begin:end, :]
         self.year_begin = year_begin
         self.year_end = year_end
         self.X = np.arange(year_begin, year_end)        
 
+    def plot_band (self, index, **kwargs):
+        if self.lower is None:
+            return
+        plt.fill_between(self.X, self.lower[index], self.upper[index], alpha=0.2, **kwargs)
+
     def plot_chinese_to_china (self):
         plt.figure()
         plt.title("Chinese Scholar to China")
         for label in LABELS:
             for i, domain in enumerate(self.meta['domains']):
                 if label == domain['display_name']:
-                    plt.plot(self.X, self.counts[i, 1, :, 1], label=label)
+                    line, = plt.plot(self.X, self.counts[i, 1, :, 1], label=label)
+                    self.plot_band((i, 1, slice(None), 1), color=line.get_color())
                     break
         plt.legend()
         plt.savefig(f'{self.root}/chinese_to_china.png')
@@ -73,6 +86,7 @@ class Analyze:
         if yesno is None:
             #counts = np.sum(self.counts, 1)
             counts = self.counts[:, 2, :, :]
+            yesno = 2
         else:
             counts = self.counts[:, yesno, :, :]
         # Use a colormap with at least 11 distinct colors
@@ -80,6 +94,7 @@ class Analyze:
         for idx, i in enumerate(ORDER):
             dest = COUNTRIES[i]
             plt.plot(self.X, counts[0, :, i], label=dest, color=colors[idx])
+            self.plot_band((0, yesno, slice(None), i), color=colors[idx])
         plt.legend()        
         title_r = title.replace(' ', '_')
         plt.savefig(f'{self.root}/{title_r}.png')
@@ -1,14 +1,34 @@
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <array>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <set>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <condition_variable>
 #include <fstream>
 #include <string>
 #include <thread>
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <type_traits>
 #include <filesystem>
 #include <format>
+#include <omp.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <nlohmann/json.hpp>
 #define BXZSTR_CONFIG_HPP
 #define BXZSTR_Z_SUPPORT 1
@@ -16,10 +36,12 @@
 #define BXZSTR_LZMA_SUPPORT 0
 #define BXZSTR_ZSTD_SUPPORT 0
 #include <bxzstr.hpp>
+#include <xtensor/xarray.hpp>
 #include <xtensor/xtensor.hpp>
 #include <xtensor/xfixed.hpp>
 #include <xtensor/xview.hpp>
 #include <xtensor/xnpy.hpp>
+#include "institution_index.h"
 
 namespace fs = std::filesystem;
 using json = nlohmann::json;
@@ -56,16 +78,48 @@ enum SurveyType {
     SURVEY_INFLOW,
     SURVEY_OUTFLOW,
     SURVEY_OUTFLOW_EXPERIENCED,
-    SURVEY_OUTFLOW_NOT_EXPERIENCED
+    SURVEY_OUTFLOW_NOT_EXPERIENCED,
+    SURVEY_STOCK            // active authors per year and country, the denominator of rates
 };
 
 int constexpr EXPERIENCED_THRESHOLD = 25;
 
+// Versions of the rules of the stages.  Bump one whenever a change alters
+// the outputs of its stage, so that results cached by the old rules are
+// recomputed.
+char const FILTER_RULES[] = "filter-1";
+char const COUNT_RULES[] = "count-1";
+
 namespace errors {
     atomic<int> bad_json(0);
     atomic<int> invalid_id(0);
 };
 
+// Command line options, set by parse_options before dispatching.
+namespace options {
+    int bootstrap = 0;      // number of bootstrap replicates, 0 = disabled
+    int snapshot = 0;       // seconds between partial result snapshots, 0 = disabled
+    double sample = 1.0;    // fraction of authors kept, by hash of the ID
+    bool csv = false;       // also export per-author records as CSV
+    bool sparse = false;    // save count tensors as compressed sparse .spt
+    int compress_level = Z_DEFAULT_COMPRESSION;     // gzip level of filter outputs
+    int compress_threads = 0;   // threads compressing filter outputs, 0 = all cores
+    bool slim = false;      // filter writes projected records
+    bool dedup = false;     // skip records superseded by a later partition
+    bool compact = false;   // institutions.json without indentation
+    bool gzip = false;      // write institutions.json.gz
+    size_t memory_budget = 0;   // MB for institution aggregation before spilling, 0 = all in memory
+    int shard_index = 0;    // --shard i/N: process every N-th input file from i
+    int shard_count = 1;
+    bool resume = false;    // reuse the checkpoints of completed input files
+};
+
+// 95% percentile band reported for bootstrap replicates
+double constexpr BOOTSTRAP_LOWER = 2.5;
+// every replicate is one more count tensor per survey of every file
+int constexpr BOOTSTRAP_MAX = 1000;
+double constexpr BOOTSTRAP_UPPER = 97.5;
+
 // A dictionary to check if a name is Chinese
 class Surnames {
     unordered_set<string> surnames;
@@ -149,6 +203,56 @@ public:
 
 CountryLookup CountryLookup::singleton;
 
+// Counter-based random numbers: the n-th draw of a key is a pure function
+// of (key, n), so results do not depend on which thread or file sees the
+// author, and the same author always gets the same draws.
+inline uint64_t mix64 (uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t counter_random (uint64_t key, uint64_t counter) {
+    return mix64(mix64(key + 0x9e3779b97f4a7c15ULL) + counter * 0x9e3779b97f4a7c15ULL);
+}
+
+// Poisson(1) weights for the Poisson bootstrap.
+// Each replicate includes the author w ~ Poisson(1) times, which
+// approximates resampling with replacement without knowing N in advance.
+class PoissonWeights {
+    static int constexpr MAX_WEIGHT = 12;   // P(w > 12) < 1e-9
+    // thresholds[k] = CDF(k) scaled to 2^64
+    array<uint64_t, MAX_WEIGHT> thresholds;
+    static PoissonWeights singleton;
+    PoissonWeights () {
+        long double p = std::exp(-1.0L);
+        long double cdf = 0;
+        for (int k = 0; k < MAX_WEIGHT; ++k) {
+            cdf += p;
+            p /= k + 1;
+            long double t = cdf * 18446744073709551616.0L;
+            thresholds[k] = t >= 18446744073709551615.0L ? UINT64_MAX : uint64_t(t);
+        }
+    }
+public:
+    // draw weights of all replicates for the author
+    static void draw (openalex_id_t author_id, int replicates, uint8_t *weights) {
+        auto const &th = singleton.thresholds;
+        for (int b = 0; b < replicates; ++b) {
+            uint64_t u = counter_random(author_id, b);
+            uint8_t w = 0;
+            for (int k = 0; k < MAX_WEIGHT; ++k) {
+                w += u >= th[k];
+            }
+            weights[b] = w;
+        }
+    }
+};
+
+PoissonWeights PoissonWeights::singleton;
+
 struct Migration {
     int year_offset;        // offset from YEAR_BEGIN
     uint32_t country_id;    // country_id == 0 means invalid
@@ -185,6 +289,11 @@ public:
     }
     */
 
+    // bitmask of the countries the author is in at the year
+    uint32_t mask (int year_offset) const {
+        return at(year_offset);
+    }
+
     bool has_gap () const {
         // where there's a gap of more than 5 years
         vector<int> years;
@@ -328,6 +437,35 @@ public:
         int country_id = __builtin_ctz(mask);   // here we assume the author is only in one country, if the author is in multiple countries, the most populus will be used
         return Migration(last_non_us_year + 1, country_id);
     }
+
+    // Call f(origin_id, destination_id, year_offset) for every country to
+    // country transition, in any direction.
+    // A transition happens at an observed year where the author no longer
+    // is in an origin country of the previous observed year.  The
+    // destinations are the countries newly appearing in that year, or, if
+    // none (e.g. US, US+CN, CN), all countries of that year.  Like
+    // Rule 6 of the outflow, an overlap year therefore dates the move to
+    // the year after it.  Authors with gaps are skipped as in the outflow.
+    template <typename F>
+    void for_each_transition (F const &f) const {
+        if (has_gap()) return;
+        uint32_t prev = 0;
+        for (int off = 0; off < TOTAL_YEARS; ++off) {
+            uint32_t cur = at(off);
+            if (cur == 0) continue;
+            uint32_t left = prev & ~cur;
+            if (left) {
+                uint32_t dest = cur & ~prev;
+                if (dest == 0) dest = cur;
+                for (uint32_t o = left; o; o &= o - 1) {
+                    for (uint32_t d = dest; d; d &= d - 1) {
+                        f(__builtin_ctz(o), __builtin_ctz(d), off);
+                    }
+                }
+            }
+            prev = cur;
+        }
+    }
 };
 
 openalex_id_t extract_id (string const &url, string const &prefix) {
@@ -444,12 +582,377 @@ struct Author {
 
 string const Author::URL_PREFIX("https://openalex.org/A");
 
+// Extract the author ID from the raw JSON line without parsing it.
+// OpenAlex author records start with the "id" key; if the line does not
+// look like that INVALID_ID is returned and the caller has to parse.
+openalex_id_t peek_author_id (string const &line) {
+    static string const KEY = "\"id\"";
+    size_t off = line.find(KEY);
+    if (off == string::npos || off > 8) return INVALID_ID;
+    off += KEY.size();
+    while (off < line.size() && (line[off] == ' ' || line[off] == ':')) ++off;
+    if (off >= line.size() || line[off] != '"') return INVALID_ID;
+    ++off;
+    if (line.compare(off, Author::URL_PREFIX.size(), Author::URL_PREFIX) != 0) return INVALID_ID;
+    off += Author::URL_PREFIX.size();
+    openalex_id_t id = 0;
+    size_t begin = off;
+    while (off < line.size() && std::isdigit(line[off])) {
+        id = id * 10 + (line[off] - '0');
+        ++off;
+    }
+    if (off == begin || off >= line.size() || line[off] != '"') return INVALID_ID;
+    return id;
+}
+
+// Deterministic sampling for --sample: an author is kept iff the hash of
+// its ID falls below the rate, so all subcommands and all runs keep the
+// same authors.  Counts saved from a sample are scaled by 1 / rate.
+class Sampler {
+    uint64_t threshold;
+    static Sampler singleton;
+public:
+    static void set_rate (double rate) {
+        options::sample = rate;
+        long double t = rate * 18446744073709551616.0L;
+        singleton.threshold = t >= 18446744073709551615.0L ? UINT64_MAX : uint64_t(t);
+    }
+
+    static bool enabled () { return options::sample < 1.0; }
+
+    static bool keep (openalex_id_t id) {
+        if (!enabled()) return true;
+        return mix64(id) < singleton.threshold;
+    }
+
+    // Decide on the raw line, so that skipped records are never parsed.
+    static bool keep (string const &line) {
+        if (!enabled()) return true;
+        openalex_id_t id = peek_author_id(line);
+        if (id == INVALID_ID) {
+            try {
+                id = extract_id(json::parse(line)["id"], Author::URL_PREFIX);
+            } catch (const json::exception& e) {
+                return true;    // let the caller report the bad record
+            }
+        }
+        return keep(id);
+    }
+
+    static void describe (json *meta) {
+        if (!enabled()) return;
+        (*meta)["sample_rate"] = options::sample;
+        (*meta)["estimate"] = true;
+    }
+};
+
+Sampler Sampler::singleton;
+
+// Cross-partition deduplication for --dedup.  An author may appear in more
+// than one updated_date=... partition; only the record of the latest
+// partition (then the last file in sorted order) is kept.  build makes a
+// lightweight pass over the IDs of all input files and remembers the
+// winning file of the duplicated IDs only; AuthorReader then drops the
+// other records of those IDs without parsing them.  Files that were not
+// part of the pass (e.g. filter outputs) are not affected.
+class Dedup {
+    static unordered_map<string, uint32_t> file_index;
+    static unordered_map<openalex_id_t, uint32_t> winners;  // duplicated IDs only
+    // per file, a hash of the duplicated IDs it has and whether it won
+    // them, 0 if it has none
+    static vector<uint64_t> file_hashes;
+public:
+    static void build (string const &datadir);
+
+    // index of the file in the pass, -1 if not part of it
+    static int64_t file (string const &path) {
+        auto it = file_index.find(path);
+        return it == file_index.end() ? -1 : int64_t(it->second);
+    }
+
+    static bool keep (string const &line, int64_t file) {
+        if (file < 0 || winners.empty()) return true;
+        openalex_id_t id = peek_author_id(line);
+        if (id == INVALID_ID) {
+            try {
+                id = extract_id(json::parse(line)["id"], Author::URL_PREFIX);
+            } catch (const json::exception& e) {
+                return true;
+            }
+        }
+        auto it = winners.find(id);
+        return it == winners.end() || it->second == file;
+    }
+
+    // Changes whenever a winner of a duplicated ID of the file changes, for
+    // the cache keys of the file; a new partition only invalidates the
+    // files it takes records from.  Empty without duplicates.
+    static string fingerprint (string const &path) {
+        int64_t f = file(path);
+        if (!options::dedup || f < 0 || file_hashes[f] == 0) return "";
+        return format("\ndedup {:016x}", file_hashes[f]);
+    }
+};
+
+unordered_map<string, uint32_t> Dedup::file_index;
+unordered_map<openalex_id_t, uint32_t> Dedup::winners;
+vector<uint64_t> Dedup::file_hashes;
+
+// Sparse tensor file (.spt) for count tensors that are mostly zeros.
+// Layout:
+//   "AASPARSE", uint64 header length, JSON header, chunk data
+// The header holds shape, dtype and the chunk index.  Nonzeros are in
+// C order of the linear index and split into chunks of SPARSE_CHUNK
+// entries; each chunk is zlib compressed and holds the delta coded int64
+// linear indices followed by the values.  A chunk entry of the index
+// records the first and last linear index of the chunk, so that a reader
+// only inflates the chunks overlapping the requested slice.
+char const SPARSE_MAGIC[] = "AASPARSE";
+size_t constexpr SPARSE_CHUNK = 1 << 16;
+
+template <typename T>
+void dump_sparse (string const &path, xt::xarray<T> const &tensor) {
+    vector<int64_t> lin;
+    vector<T> val;
+    auto const *data = tensor.data();
+    for (size_t i = 0; i < tensor.size(); ++i) {
+        if (data[i] != 0) {
+            lin.push_back(i);
+            val.push_back(data[i]);
+        }
+    }
+    json header;
+    header["shape"] = vector<size_t>(tensor.shape().begin(), tensor.shape().end());
+    header["dtype"] = std::is_same_v<T, double> ? "<f8" : "<i4";
+    header["nnz"] = lin.size();
+    json chunks = json::array();
+    string body;
+    for (size_t begin = 0; begin < lin.size(); begin += SPARSE_CHUNK) {
+        size_t end = std::min(lin.size(), begin + SPARSE_CHUNK);
+        size_t n = end - begin;
+        string raw(n * (sizeof(int64_t) + sizeof(T)), '\0');
+        int64_t *delta = reinterpret_cast<int64_t *>(&raw[0]);
+        int64_t prev = 0;
+        for (size_t i = 0; i < n; ++i) {
+            delta[i] = lin[begin + i] - prev;
+            prev = lin[begin + i];
+        }
+        memcpy(&raw[n * sizeof(int64_t)], &val[begin], n * sizeof(T));
+        uLongf size = compressBound(raw.size());
+        string packed(size, '\0');
+        if (compress2(reinterpret_cast<Bytef *>(&packed[0]), &size,
+                      reinterpret_cast<Bytef const *>(raw.data()), raw.size(), 6) != Z_OK) {
+            cerr << "Failed to compress " << path << endl;
+            throw 0;
+        }
+        chunks.push_back({{"first", lin[begin]},
+                          {"last", lin[end - 1]},
+                          {"offset", body.size()},
+                          {"bytes", size},
+                          {"nnz", n}});
+        body.append(packed, 0, size);
+    }
+    header["chunks"] = chunks;
+    string h = header.dump();
+    uint64_t hlen = h.size();
+    ofstream os(path, std::ios::binary);
+    os.write(SPARSE_MAGIC, 8);
+    os.write(reinterpret_cast<char const *>(&hlen), sizeof(hlen));
+    os.write(h.data(), h.size());
+    os.write(body.data(), body.size());
+}
+
+// Memory-mapped reader of .spt files that densifies only a slice.
+// sparse_tensor.py is the numpy equivalent.
+class SparseTensor {
+    void *base;
+    size_t length;
+    char const *body;
+    json header;
+public:
+    vector<size_t> shape;
+    string dtype;
+
+    SparseTensor (string const &path): base(MAP_FAILED), length(0), body(nullptr) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Cannot open " << path << endl;
+            throw 0;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        length = st.st_size;
+        base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        char const *p = static_cast<char const *>(base);
+        if (base == MAP_FAILED || length < 16 || memcmp(p, SPARSE_MAGIC, 8) != 0) {
+            cerr << "Not a sparse tensor file: " << path << endl;
+            throw 0;
+        }
+        uint64_t hlen;
+        memcpy(&hlen, p + 8, sizeof(hlen));
+        header = json::parse(p + 16, p + 16 + hlen);
+        body = p + 16 + hlen;
+        shape = header["shape"].get<vector<size_t>>();
+        dtype = header["dtype"];
+    }
+
+    ~SparseTensor () {
+        if (base != MAP_FAILED) munmap(base, length);
+    }
+
+    SparseTensor (SparseTensor const &) = delete;
+    SparseTensor &operator = (SparseTensor const &) = delete;
+
+    // Densify the box [lo[d], hi[d]) of every dimension.
+    template <typename T>
+    xt::xarray<T> densify (vector<size_t> const &lo, vector<size_t> const &hi) const {
+        size_t nd = shape.size();
+        if ((dtype == "<f8") != std::is_same_v<T, double>) {
+            cerr << "Wrong dtype for sparse tensor: " << dtype << endl;
+            throw 0;
+        }
+        vector<size_t> box(nd);
+        vector<int64_t> strides(nd);
+        int64_t first = 0, last = 0, stride = 1;
+        for (int d = nd - 1; d >= 0; --d) {
+            if (!(lo[d] < hi[d] && hi[d] <= shape[d])) {
+                cerr << "Invalid slice of dimension " << d << endl;
+                throw 0;
+            }
+            box[d] = hi[d] - lo[d];
+            strides[d] = stride;
+            first += lo[d] * stride;
+            last += (hi[d] - 1) * stride;
+            stride *= shape[d];
+        }
+        xt::xarray<T> out = xt::zeros<T>(box);
+        string raw;
+        for (auto const &chunk: header["chunks"]) {
+            if (chunk["last"].get<int64_t>() < first || chunk["first"].get<int64_t>() > last) continue;
+            size_t n = chunk["nnz"];
+            raw.resize(n * (sizeof(int64_t) + sizeof(T)));
+            uLongf size = raw.size();
+            if (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &size,
+                           reinterpret_cast<Bytef const *>(body + chunk["offset"].get<size_t>()),
+                           chunk["bytes"].get<size_t>()) != Z_OK || size != raw.size()) {
+                cerr << "Corrupted sparse tensor chunk" << endl;
+                throw 0;
+            }
+            int64_t const *delta = reinterpret_cast<int64_t const *>(raw.data());
+            T const *val = reinterpret_cast<T const *>(raw.data() + n * sizeof(int64_t));
+            int64_t lin = 0;
+            for (size_t i = 0; i < n; ++i) {
+                lin += delta[i];
+                if (lin < first || lin > last) continue;
+                size_t off = 0;
+                bool inside = true;
+                for (size_t d = 0; d < nd; ++d) {
+                    size_t idx = lin / strides[d] % shape[d];
+                    if (idx < lo[d] || idx >= hi[d]) {
+                        inside = false;
+                        break;
+                    }
+                    off = off * box[d] + (idx - lo[d]);
+                }
+                if (inside) out.data()[off] = val[i];
+            }
+        }
+        return out;
+    }
+};
+
+// Save a count tensor as <stem>.npy, or <stem>.spt with --sparse.
+// Counts are scaled to estimates of the full population when sampling.
+template <typename T>
+void dump_counts (string const &stem, T const &counts) {
+    if (Sampler::enabled()) {
+        xt::xarray<double> scaled = xt::cast<double>(counts) / options::sample;
+        if (options::sparse) dump_sparse(stem + ".spt", scaled);
+        else xt::dump_npy(stem + ".npy", scaled);
+        return;
+    }
+    if (options::sparse) dump_sparse(stem + ".spt", xt::xarray<int>(counts));
+    else xt::dump_npy(stem + ".npy", counts);
+}
+
+// Slim records: the filter can write only the fields that Author and
+// list_institutions read, after a version header line.  Slim records have
+// the same structure as the originals, so readers only skip the header.
+int constexpr SLIM_VERSION = 1;
+string const SLIM_HEADER_KEY = "{\"aasf_slim\":";
+
+string slim_header () {
+    return format("{}{}}}", SLIM_HEADER_KEY, SLIM_VERSION);
+}
+
+string slim_record (json const &j) {
+    // ordered, so that "id" stays the first key for peek_author_id
+    nlohmann::ordered_json out;
+    out["id"] = j["id"];
+    out["display_name"] = j["display_name"];
+    if (j.contains("display_name_alternatives")) {
+        out["display_name_alternatives"] = j["display_name_alternatives"];
+    }
+    out["works_count"] = j["works_count"];
+    if (j.contains("topics")) {
+        out["topics"] = nlohmann::ordered_json::array();
+        for (auto const &topic : j["topics"]) {
+            nlohmann::ordered_json t;
+            t["domain"]["id"] = topic["domain"]["id"];
+            t["domain"]["display_name"] = topic["domain"]["display_name"];
+            t["field"]["id"] = topic["field"]["id"];
+            out["topics"].push_back(t);
+        }
+    }
+    if (j.contains("affiliations")) {
+        out["affiliations"] = nlohmann::ordered_json::array();
+        for (auto const &affiliation : j["affiliations"]) {
+            nlohmann::ordered_json a;
+            a["institution"]["id"] = affiliation["institution"]["id"];
+            a["institution"]["display_name"] = affiliation["institution"]["display_name"];
+            a["institution"]["country_code"] = affiliation["institution"]["country_code"];
+            a["years"] = affiliation["years"];
+            out["affiliations"].push_back(a);
+        }
+    }
+    return out.dump();
+}
+
+// Reads the author records of an input file line by line, original or
+// slim, skipping the authors dropped by --sample.
+class AuthorReader {
+    bxz::ifstream is;
+    string path;
+    int64_t dedup_file;
+public:
+    AuthorReader (string const &path_): is(path_), path(path_), dedup_file(Dedup::file(path_)) {}
+
+    bool next (string *line) {
+        while (getline(is, *line)) {
+            if (line->starts_with(SLIM_HEADER_KEY)) {
+                int version = json::parse(*line)["aasf_slim"];
+                if (version != SLIM_VERSION) {
+                    cerr << "Unsupported slim record version " << version << " in " << path << endl;
+                    throw 0;
+                }
+                continue;
+            }
+            if (!Sampler::keep(*line)) continue;
+            if (!Dedup::keep(*line, dedup_file)) continue;
+            return true;
+        }
+        return false;
+    }
+};
+
 // Function to process a file and extract matching authors
 void test (string const &path) {
     ifstream is(path);
     for (;;) {
         string line;
         if (!getline(is, line)) break;
+        if (!Sampler::keep(line)) continue;
         try {
             Author author(json::parse(line));
             json out;
@@ -463,61 +966,199 @@ void test (string const &path) {
     }
 }
 
-void scan_files (string const &datadir, vector<string> *paths) {
+// All input files under datadir in sorted order
+vector<string> list_files (string const &datadir) {
+    vector<string> all;
     for (const auto& entry : fs::recursive_directory_iterator(datadir)) {
         if (entry.is_regular_file() && entry.path().extension() == ".gz") {
-            paths->push_back(entry.path().string());
+            all.push_back(entry.path().string());
         }
     }
+    std::sort(all.begin(), all.end());
+    return all;
 }
 
-void filter_relevant (string const &datadir) {
-    vector<string> files;
-    scan_files(datadir, &files);
-    cout << "Found " << files.size() << " files" << endl;
-    int done = 0;
-    int total_in = 0;
-    int total_inflow = 0;
-    int total_outflow = 0;
-    fs::create_directory("data/filtered_inflow");
-    fs::create_directory("data/filtered_outflow");
-    #pragma omp parallel for
-    for (size_t i = 0; i < files.size(); ++i) {
-        bxz::ifstream iss(files[i]);
-        bxz::ofstream inflow(format("data/filtered_inflow/{}.gz", i), bxz::z);
-        bxz::ofstream outflow(format("data/filtered_outflow/{}.gz", i), bxz::z);
-        string line;
-        int count_in = 0;
-        int count_inflow = 0;
-        int count_outflow = 0;
-        while (getline(iss, line)) {
-            try {
-                Author author(json::parse(line));
-                ++count_in;
-                if (author.years.is_inflow()) {
-                    ++count_inflow;
-                    inflow << line << endl;
-                }
-                if (author.years.is_outflow()) {
-                    ++count_outflow;
-                    outflow << line << endl;
-                }
-            } catch (const json::exception& e) {
-                errors::bad_json += 1;
+// List the input files in sorted order.  With --shard i/N only the files
+// at positions i, i + N, ... are kept, so that N processes (on any number
+// of machines) cover disjoint subsets.
+void scan_files (string const &datadir, vector<string> *paths) {
+    vector<string> all = list_files(datadir);
+    for (size_t i = options::shard_index; i < all.size(); i += options::shard_count) {
+        paths->push_back(all[i]);
+    }
+}
+
+// Identity of an input file for caches and manifests; a file whose size
+// or mtime changed is treated as a different input.
+json file_identity (string const &path) {
+    return {{"path", path},
+            {"size", fs::file_size(path)},
+            {"mtime", int64_t(fs::last_write_time(path).time_since_epoch().count())}};
+}
+
+uint64_t fnv1a (string const &str) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c: str) {
+        h = (h ^ uint8_t(c)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Binary serialization of partial results, in native byte order.
+template <typename T>
+void write_pod (std::ostream &os, T const &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    os.write(reinterpret_cast<char const *>(&value), sizeof(T));
+}
+
+template <typename T>
+T read_pod (std::istream &is) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+    if (!is) {
+        cerr << "Truncated binary input" << endl;
+        throw 0;
+    }
+    return value;
+}
+
+void write_string (std::ostream &os, string const &str) {
+    write_pod<uint64_t>(os, str.size());
+    os.write(str.data(), str.size());
+}
+
+string read_string (std::istream &is) {
+    string str(read_pod<uint64_t>(is), '\0');
+    is.read(&str[0], str.size());
+    return str;
+}
+
+// Per-file checkpoints.  The partial result of every completed input file
+// is written atomically (the file existing is the completion marker), so
+// that after a crash a rerun with --resume loads finished files instead of
+// scanning them again.
+//
+// Given a fingerprint of the stage rules and options, the key covers the
+// input identity (path, size, mtime) and the fingerprint, so results made
+// with other options are never loaded.  With cache set the checkpoints are
+// a content-addressed cache: results are reused on every run, with or
+// without --resume, as long as the key is unchanged.
+class Checkpoint {
+    string dir;
+    string fingerprint;
+    bool cache;
+
+    // what the key is a hash of, also stored to detect collisions
+    string ident (string const &input) const {
+        if (fingerprint.empty()) return input;
+        return fingerprint + "\n" + file_identity(input).dump() + Dedup::fingerprint(input);
+    }
+
+    string path (string const &input) const {
+        return format("{}/{}.bin", dir, key(input));
+    }
+
+public:
+    Checkpoint (string const &dir_, string const &fingerprint_ = "", bool cache_ = true)
+        : dir(dir_), fingerprint(fingerprint_), cache(cache_) {
+        fs::create_directories(dir);
+    }
+
+    string key (string const &input) const {
+        return format("{:016x}", fnv1a(ident(input)));
+    }
+
+    bool done (string const &input) const {
+        return (options::resume || (cache && !fingerprint.empty())) && fs::exists(path(input));
+    }
+
+    void save (string const &input, std::function<void(std::ostream &)> const &write) const {
+        string final_path = path(input);
+        string tmp = final_path + ".tmp";
+        {
+            ofstream os(tmp, std::ios::binary);
+            write_string(os, ident(input));
+            write(os);
+            if (!os) {
+                cerr << "Failed to write checkpoint " << tmp << endl;
+                throw 0;
             }
         }
-        #pragma omp critical
-        {
-            total_in += count_in;
-            total_inflow += count_inflow;
-            total_outflow += count_outflow;
-            ++done;
-            cout << format("Processed {}/{}: {} => inflow {} / outflow {}, ratio = {:.4f} {:.4f}",
-                done, files.size(), count_in, count_inflow, count_outflow, 1.0 * count_inflow / count_in, 1.0 * count_outflow / count_in) << endl;
+        fs::rename(tmp, final_path);
+    }
+
+    void load (string const &input, std::function<void(std::istream &)> const &read) const {
+        ifstream is(path(input), std::ios::binary);
+        if (read_string(is) != ident(input)) {
+            cerr << "Checkpoint hash collision for " << input << endl;
+            throw 0;
         }
+        read(is);
     }
-    cout << format("Total: {} => inflow {} / outflow {}, ratio = {:.4f} {:.4f}", total_in, total_inflow, total_outflow, 1.0 * total_inflow / total_in, 1.0 * total_outflow / total_in) << endl;
-    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+};
+
+// Checkpoints of a count stage under outdir.  Shards sharing an outdir
+// each get their own directory, so that a shard finishing does not remove
+// the checkpoints the others are still writing.
+string checkpoint_dir (string const &outdir, string const &stage) {
+    if (options::shard_count == 1) return format("{}/.checkpoint/{}", outdir, stage);
+    return format("{}/.checkpoint/shard-{}-of-{}/{}", outdir, options::shard_index, options::shard_count, stage);
+}
+
+// the final results are written, the checkpoints of the stages are no
+// longer needed; the parent directories go once empty
+void clear_checkpoints (string const &outdir, vector<string> const &stages) {
+    std::error_code ec;
+    for (auto const &stage: stages) {
+        fs::path dir = checkpoint_dir(outdir, stage);
+        fs::remove_all(dir);
+        for (dir = dir.parent_path(); dir != fs::path(outdir); dir = dir.parent_path()) {
+            fs::remove(dir, ec);
+        }
+    }
+}
+
+// Remove the "<key>.<ext>" files of dir whose key is not in keys, i.e.
+// outputs of inputs that changed or are gone.
+void remove_stale (string const &dir, string const &ext, unordered_set<string> const &keys) {
+    for (auto const &entry: fs::directory_iterator(dir)) {
+        if (entry.path().extension() != ext) continue;
+        if (keys.count(entry.path().stem().string()) == 0) {
+            fs::remove(entry.path());
+        }
+    }
+}
+
+// The manifest of a stage: its rules and options and, for every input,
+// its identity and what was made of it.
+json make_manifest (json const &fingerprint, json const &entries) {
+    json manifest;
+    manifest["fingerprint"] = fingerprint;
+    manifest["entries"] = entries;
+    return manifest;
+}
+
+// true if the manifest at path was written for exactly this manifest,
+// i.e. the stage would redo the same work
+bool manifest_current (string const &path, json const &manifest) {
+    ifstream is(path);
+    if (!is) return false;
+    try {
+        return json::parse(is) == manifest;
+    } catch (const json::exception& e) {
+        return false;
+    }
+}
+
+void write_manifest (string const &path, json const &fingerprint, json const &entries) {
+    json manifest = make_manifest(fingerprint, entries);
+    string tmp = path + ".tmp";
+    {
+        ofstream os(tmp);
+        os << manifest.dump(2) << endl;
+    }
+    fs::rename(tmp, path);
 }
 
 // migration count in each domain
@@ -526,9 +1167,12 @@ struct DomainCount: public Domain {
     // Dim 1: year
     // Dim 2: destination country
     xt::xtensor_fixed<int, xt::xshape<3, TOTAL_YEARS, NUM_COUNTRIES>> counts;
+    // Bootstrap replicates of counts, replicate being the last
+    // (contiguous) dimension; empty unless --bootstrap is given.
+    xt::xtensor<int, 4> replicates;
     DomainCount (): Domain() { counts.fill(0); }
 
-    void add (int id, string const &name, int is_chinese, int year_offset, int country_id, int delta = 1) {
+    void add (int id, string const &name, int is_chinese, int year_offset, int country_id, int delta = 1, uint8_t const *weights = nullptr) {
         if (this->display_name.empty()) {
             this->id = id;
             this->display_name = name;
@@ -538,21 +1182,85 @@ struct DomainCount: public Domain {
         }
         counts(is_chinese, year_offset, country_id) += delta;
         counts(2, year_offset, country_id) += delta;
+        if (weights) {
+            int B = options::bootstrap;
+            if (replicates.size() == 0) {
+                replicates = xt::zeros<int>({size_t(3), size_t(TOTAL_YEARS), size_t(NUM_COUNTRIES), size_t(B)});
+            }
+            int *one = &replicates(is_chinese, year_offset, country_id, 0);
+            int *all = &replicates(2, year_offset, country_id, 0);
+            for (int b = 0; b < B; ++b) {
+                one[b] += delta * weights[b];
+                all[b] += delta * weights[b];
+            }
+        }
     }
 
     void merge (DomainCount const &other) {
         add(other.id, other.display_name, 0, 0, 0, 0);
         counts += other.counts;
+        if (other.replicates.size() > 0) {
+            if (replicates.size() == 0) replicates = other.replicates;
+            else replicates += other.replicates;
+        }
+    }
+
+    void write (std::ostream &os) const {
+        write_pod<int64_t>(os, id);
+        write_string(os, display_name);
+        os.write(reinterpret_cast<char const *>(counts.data()), counts.size() * sizeof(int));
+        write_pod<uint64_t>(os, replicates.size() > 0 ? replicates.shape(3) : 0);
+        os.write(reinterpret_cast<char const *>(replicates.data()), replicates.size() * sizeof(int));
+    }
+
+    void read (std::istream &is) {
+        id = read_pod<int64_t>(is);
+        display_name = read_string(is);
+        is.read(reinterpret_cast<char *>(counts.data()), counts.size() * sizeof(int));
+        size_t B = read_pod<uint64_t>(is);
+        if (B > 0) {
+            replicates = xt::zeros<int>({size_t(3), size_t(TOTAL_YEARS), size_t(NUM_COUNTRIES), B});
+            is.read(reinterpret_cast<char *>(replicates.data()), replicates.size() * sizeof(int));
+        }
+        if (!is) {
+            cerr << "Truncated domain counts" << endl;
+            throw 0;
+        }
+    }
+
+    // percentile of the bootstrap replicates of each count
+    xt::xtensor<int, 3> percentile (double q) const {
+        xt::xtensor<int, 3> out = xt::zeros<int>({size_t(3), size_t(TOTAL_YEARS), size_t(NUM_COUNTRIES)});
+        if (replicates.size() == 0) return out;
+        size_t B = replicates.shape(3);
+        size_t rank = std::min(B - 1, size_t(q / 100 * B));
+        vector<int> buf(B);
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t y = 0; y < TOTAL_YEARS; ++y) {
+                for (size_t c = 0; c < NUM_COUNTRIES; ++c) {
+                    int const *r = &replicates(i, y, c, 0);
+                    buf.assign(r, r + B);
+                    std::nth_element(buf.begin(), buf.begin() + rank, buf.end());
+                    out(i, y, c) = buf[rank];
+                }
+            }
+        }
+        return out;
     }
 };
 
 struct Survey {
     unordered_map<openalex_id_t, DomainCount> domains;
     SurveyType type;
+    vector<uint8_t> weights;    // bootstrap weights of the current author
 
     Survey (SurveyType type_ = SURVEY_INFLOW): type(type_) {}
 
     void add (Author const &author) {
+        if (type == SURVEY_STOCK) {
+            add_stock(author);
+            return;
+        }
         if (type == SURVEY_OUTFLOW_EXPERIENCED) {
             if (author.works_count < EXPERIENCED_THRESHOLD) return;
         }
@@ -564,15 +1272,92 @@ struct Survey {
         if (year_offset < 0) return;
         //if (mig.country_id == OTHER_COUNTRY_ID) return;
         int is_chinese = Surnames::is_chinese(author.display_name) ? 1 : 0;
+        uint8_t const *w = draw_weights(author);
         for (auto const &[id, name] : author.domains) {
-            domains[id].add(id, name, is_chinese, year_offset, mig.country_id);
+            domains[id].add(id, name, is_chinese, year_offset, mig.country_id, 1, w);
+        }
+    }
+
+    // count the author once for every (year, country) with an affiliation
+    void add_stock (Author const &author) {
+        int is_chinese = -1;
+        uint8_t const *w = nullptr;
+        for (int year_offset = 0; year_offset < TOTAL_YEARS; ++year_offset) {
+            uint32_t mask = author.years.mask(year_offset);
+            if (mask == 0) continue;
+            if (is_chinese < 0) {
+                is_chinese = Surnames::is_chinese(author.display_name) ? 1 : 0;
+                w = draw_weights(author);
+            }
+            for (; mask; mask &= mask - 1) {
+                int country_id = __builtin_ctz(mask);
+                for (auto const &[id, name] : author.domains) {
+                    domains[id].add(id, name, is_chinese, year_offset, country_id, 1, w);
+                }
+            }
+        }
+    }
+
+    // bootstrap weights of the author, nullptr if bootstrap is disabled
+    uint8_t const *draw_weights (Author const &author) {
+        return draw_weights(author.id);
+    }
+    uint8_t const *draw_weights (openalex_id_t author_id) {
+        if (options::bootstrap <= 0) return nullptr;
+        weights.resize(options::bootstrap);
+        PoissonWeights::draw(author_id, options::bootstrap, &weights[0]);
+        return &weights[0];
+    }
+    // add delta to the cells of one migration of an author whose domains
+    // are given as a domain_mask; the domains must already be present,
+    // false if one is missing (its cells are skipped)
+    bool add_cells (openalex_id_t author_id, uint32_t mask, int is_chinese, int year_offset, int country_id, int delta) {
+        uint8_t const *w = draw_weights(author_id);
+        bool ok = true;
+        for (; mask; mask &= mask - 1) {
+            openalex_id_t id = __builtin_ctz(mask) + EnCS_DOMAIN_ID;
+            auto it = domains.find(id);
+            if (it == domains.end()) {
+                cerr << "Domain " << id << " missing from the survey" << endl;
+                ok = false;
+                continue;
+            }
+            it->second.add(id, it->second.display_name, is_chinese, year_offset, country_id, delta, w);
         }
+        return ok;
+    }
+    // drop domains left without any count, as a fresh run would not have them
+    void prune () {
+        std::erase_if(domains, [](auto const &item) {
+            auto const &counts = item.second.counts;
+            return std::all_of(counts.begin(), counts.end(), [](int v) { return v == 0; });
+        });
     }
     void merge (Survey const &other) {
         for (auto const &[id, count] : other.domains) {
             domains[id].merge(count);
         }
     }
+    void write (std::ostream &os) const {
+        write_pod<int32_t>(os, type);
+        write_pod<uint64_t>(os, domains.size());
+        for (auto const &[id, domain]: domains) {
+            domain.write(os);
+        }
+    }
+    // read a survey written by write and merge it into this one
+    void read (std::istream &is) {
+        if (read_pod<int32_t>(is) != type) {
+            cerr << "Survey type mismatch" << endl;
+            throw 0;
+        }
+        size_t n = read_pod<uint64_t>(is);
+        for (size_t i = 0; i < n; ++i) {
+            DomainCount domain;
+            domain.read(is);
+            domains[domain.id].merge(domain);
+        }
+    }
     void save (string const &path) const {
        json meta;
        meta["year_begin"] = YEAR_BEGIN;
@@ -588,201 +1373,3079 @@ struct Survey {
            ++i;
        }
        meta["domains"] = jdomains;
+       Sampler::describe(&meta);
+       if (options::bootstrap > 0) {
+           meta["bootstrap"] = {{"replicates", options::bootstrap},
+                                {"lower", BOOTSTRAP_LOWER},
+                                {"upper", BOOTSTRAP_UPPER}};
+       }
        fs::create_directories(path);
        ofstream os(path + "/meta.json");
        os << meta.dump(2) << endl;
-       xt::dump_npy(path + "/counts.npy", counts);
+       dump_counts(path + "/counts", counts);
+       if (options::bootstrap > 0) {
+           // percentile bands, same layout as counts.npy
+           xt::xtensor<int, 4> lower = xt::zeros_like(counts);
+           xt::xtensor<int, 4> upper = xt::zeros_like(counts);
+           int i = 0;
+           for (auto const &[id, domain]: domains) {
+               xt::view(lower, i, xt::all(), xt::all(), xt::all()) = domain.percentile(BOOTSTRAP_LOWER);
+               xt::view(upper, i, xt::all(), xt::all(), xt::all()) = domain.percentile(BOOTSTRAP_UPPER);
+               ++i;
+           }
+           dump_counts(path + "/counts_lower", lower);
+           dump_counts(path + "/counts_upper", upper);
+       }
     }
 };
 
-void count_migration_inflow (string const &datadir, string const &outdir) {
-    vector<string> files;
-    scan_files(datadir, &files);
-    cout << "Found " << files.size() << " files" << endl;
-    int done = 0;
-    Survey survey(SURVEY_INFLOW);
-    #pragma omp parallel for
-    for (size_t i = 0; i < files.size(); ++i) {
-        bxz::ifstream iss(files[i]);
-        string line;
-        Survey local(SURVEY_INFLOW);
-        while (getline(iss, line)) {
-            try {
-                Author author(json::parse(line));
-                local.add(author);
-            } catch (const json::exception& e) {
-                errors::bad_json += 1;
-            }
+// Threads compressing blocks of output into independent gzip members,
+// shared by all BlockWriters so that compression does not run on the
+// threads that parse.
+class CompressPool {
+    vector<std::thread> workers;
+    std::queue<std::packaged_task<string()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop;
+
+    CompressPool (int threads): stop(false) {
+        if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([this] {
+                for (;;) {
+                    std::packaged_task<string()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this] { return stop || !tasks.empty(); });
+                        if (tasks.empty()) return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
         }
-        #pragma omp critical
+    }
+
+    ~CompressPool () {
         {
-            survey.merge(local);
-            ++done;
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &worker: workers) worker.join();
+    }
+
+    static string gzip (string const &block, int level) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // window bits 15 + 16: gzip wrapper
+        if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            cerr << "deflateInit2 failed" << endl;
+            throw 0;
+        }
+        string out(deflateBound(&z, block.size()), '\0');
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block.data()));
+        z.avail_in = block.size();
+        z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+        z.avail_out = out.size();
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+            cerr << "deflate failed" << endl;
+            throw 0;
+        }
+        out.resize(z.total_out);
+        deflateEnd(&z);
+        return out;
+    }
+
+public:
+    static CompressPool &get () {
+        static CompressPool singleton(options::compress_threads);
+        return singleton;
+    }
+
+    std::future<string> submit (string &&block) {
+        int level = options::compress_level;
+        std::packaged_task<string()> task([block = std::move(block), level] {
+            return gzip(block, level);
+        });
+        auto future = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push(std::move(task));
+        }
+        cv.notify_one();
+        return future;
+    }
+};
+
+// Line writer producing a .gz file as a sequence of gzip members, one per
+// block, compressed on CompressPool and written in order.  Concatenated
+// gzip members are a valid gzip file for bxz::ifstream, zcat and pigz.
+class BlockWriter {
+    static size_t constexpr BLOCK_SIZE = 4 << 20;
+    static size_t constexpr MAX_PENDING = 4;    // blocks in flight per writer
+    ofstream os;
+    string block;
+    std::deque<std::future<string>> pending;
+
+    void drain (size_t keep) {
+        while (pending.size() > keep
+               || (!pending.empty() && pending.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+            string data = pending.front().get();
+            os.write(data.data(), data.size());
+            pending.pop_front();
+        }
+    }
+
+    void submit () {
+        if (block.empty()) return;
+        pending.push_back(CompressPool::get().submit(std::move(block)));
+        block = string();
+        block.reserve(BLOCK_SIZE + (1 << 16));
+        drain(MAX_PENDING);
+    }
+
+public:
+    BlockWriter (string const &path): os(path, std::ios::binary) {
+        block.reserve(BLOCK_SIZE + (1 << 16));
+    }
+
+    ~BlockWriter () {
+        close();
+    }
+
+    void write (string const &line) {
+        block.append(line);
+        block.push_back('\n');
+        if (block.size() >= BLOCK_SIZE) submit();
+    }
+
+    void close () {
+        if (!os.is_open()) return;
+        submit();
+        drain(0);
+        os.close();
+    }
+};
+
+// The stock of a --shard filter run, combined by the merge subcommand
+// into data/stock like the count partials.
+char const STOCK_PARTIAL_MAGIC[] = "AASTCK01";
+
+void write_stock_partial (string const &path, Survey const &stock) {
+    json header;
+    header["shard_index"] = options::shard_index;
+    header["shard_count"] = options::shard_count;
+    header["sample"] = options::sample;
+    header["bootstrap"] = options::bootstrap;
+    string tmp = path + ".tmp";
+    {
+        ofstream os(tmp, std::ios::binary);
+        os.write(STOCK_PARTIAL_MAGIC, 8);
+        write_string(os, header.dump());
+        stock.write(os);
+        if (!os) {
+            cerr << "Failed to write " << tmp << endl;
+            throw 0;
+        }
+    }
+    fs::rename(tmp, path);
+}
+
+bool is_stock_partial (string const &path) {
+    ifstream is(path, std::ios::binary);
+    char magic[8];
+    is.read(magic, 8);
+    return is && memcmp(magic, STOCK_PARTIAL_MAGIC, 8) == 0;
+}
+
+// merge the n-th stock partial into stock
+void read_stock_partial (string const &path, int n, Survey *stock) {
+    ifstream is(path, std::ios::binary);
+    char magic[8];
+    is.read(magic, 8);
+    if (!is || memcmp(magic, STOCK_PARTIAL_MAGIC, 8) != 0) {
+        cerr << "Not a stock partial: " << path << endl;
+        throw 0;
+    }
+    json header = json::parse(read_string(is));
+    if (n == 0) {
+        Sampler::set_rate(header["sample"].get<double>());
+        options::bootstrap = header["bootstrap"];
+    }
+    else if (header["sample"].get<double>() != options::sample
+            || header["bootstrap"].get<int>() != options::bootstrap) {
+        cerr << "Partial " << path << " was made with other --sample / --bootstrap options" << endl;
+        throw 0;
+    }
+    stock->read(is);
+}
+
+// One author record of a scan: the raw line, its JSON and, built on first
+// use, the Author, so that consumers sharing a scan parse it only once.
+class AuthorRecord {
+    std::optional<Author> parsed;
+public:
+    string const &line;
+    json const &j;
+    AuthorRecord (string const &line_, json const &j_): line(line_), j(j_) {}
+    Author const &author () {
+        if (!parsed) parsed.emplace(j);
+        return *parsed;
+    }
+};
+
+// A stage fed by scan_authors.  start is called once with the input files,
+// then every input file is opened in a worker thread; the File it returns
+// sees each record and is finished in the same thread, which is where it
+// merges into the consumer (under a lock).  open returns nullptr if the
+// consumer has nothing to do with the file, and the file is not read at
+// all if no consumer wants it.  finish runs after all files.
+class ScanConsumer {
+public:
+    class File {
+    public:
+        virtual ~File () {}
+        // throws json::exception on a bad record
+        virtual void add (AuthorRecord &record) = 0;
+        virtual void finish () = 0;
+    };
+    virtual ~ScanConsumer () {}
+    virtual void start (vector<string> const &) {}
+    virtual std::unique_ptr<File> open (string const &path) = 0;
+    virtual void finish () = 0;
+};
+
+// Decompress and parse the input files of datadir once, fanning every
+// record out to all consumers.  A record rejected by any consumer counts
+// as one bad JSON.
+void scan_authors (string const &datadir, vector<ScanConsumer *> const &consumers) {
+    Dedup::build(datadir);
+    vector<string> files;
+    scan_files(datadir, &files);
+    cout << "Found " << files.size() << " files" << endl;
+    for (auto consumer: consumers) consumer->start(files);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < files.size(); ++i) {
+        vector<std::unique_ptr<ScanConsumer::File>> opened;
+        for (auto consumer: consumers) {
+            auto file = consumer->open(files[i]);
+            if (file) opened.push_back(std::move(file));
+        }
+        if (!opened.empty()) {
+            AuthorReader reader(files[i]);
+            string line;
+            while (reader.next(&line)) {
+                bool bad = false;
+                try {
+                    json j = json::parse(line);
+                    AuthorRecord record(line, j);
+                    for (auto &file: opened) {
+                        try {
+                            file->add(record);
+                        } catch (const json::exception& e) {
+                            bad = true;
+                        }
+                    }
+                } catch (const json::exception& e) {
+                    bad = true;
+                }
+                if (bad) errors::bad_json += 1;
+            }
+        }
+        for (auto &file: opened) file->finish();
+    }
+    for (auto consumer: consumers) consumer->finish();
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+}
+
+// Outputs are named by the cache key of their input, so an input whose
+// identity and the filter rules / options are unchanged is never filtered
+// again, and data/filter_manifest.json records what made each output.
+class FilterConsumer: public ScanConsumer {
+    string datadir;
+    json fingerprint;
+    std::unique_ptr<Checkpoint> cache;
+    size_t total_files = 0;
+    int done = 0;
+    int total_in = 0;
+    int total_inflow = 0;
+    int total_outflow = 0;
+    // active authors, so that rates are a division of the migration counts
+    Survey stock;
+    json entries = json::array();
+
+    void merge (string const &path, bool cached, int count_in, int count_inflow, int count_outflow, Survey const &local_stock) {
+        #pragma omp critical
+        {
+            total_in += count_in;
+            total_inflow += count_inflow;
+            total_outflow += count_outflow;
+            stock.merge(local_stock);
+            json entry = file_identity(path);
+            entry["key"] = cache->key(path);
+            entry["authors"] = count_in;
+            entry["inflow"] = count_inflow;
+            entry["outflow"] = count_outflow;
+            entries.push_back(entry);
+            ++done;
+            cout << format("Processed {}/{}{}: {} => inflow {} / outflow {}, ratio = {:.4f} {:.4f}",
+                done, total_files, cached ? " (cached)" : "", count_in, count_inflow, count_outflow, 1.0 * count_inflow / count_in, 1.0 * count_outflow / count_in) << endl;
+        }
+    }
+
+    class File: public ScanConsumer::File {
+        FilterConsumer &filter;
+        string path;
+        // outputs are renamed into place once complete
+        string inflow_path;
+        string outflow_path;
+        BlockWriter inflow;
+        BlockWriter outflow;
+        int count_in = 0;
+        int count_inflow = 0;
+        int count_outflow = 0;
+        Survey local_stock;
+    public:
+        File (FilterConsumer &filter_, string const &path_, string const &key)
+            : filter(filter_), path(path_),
+              inflow_path(format("data/filtered_inflow/{}.gz", key)),
+              outflow_path(format("data/filtered_outflow/{}.gz", key)),
+              inflow(inflow_path + ".tmp"), outflow(outflow_path + ".tmp"),
+              local_stock(SURVEY_STOCK) {
+            if (options::slim) {
+                inflow.write(slim_header());
+                outflow.write(slim_header());
+            }
+        }
+
+        void add (AuthorRecord &record) {
+            Author const &author = record.author();
+            ++count_in;
+            local_stock.add(author);
+            bool is_inflow = author.years.is_inflow();
+            bool is_outflow = author.years.is_outflow();
+            string slim;
+            if (options::slim && (is_inflow || is_outflow)) {
+                slim = slim_record(record.j);
+            }
+            string const &line = options::slim ? slim : record.line;
+            if (is_inflow) {
+                ++count_inflow;
+                inflow.write(line);
+            }
+            if (is_outflow) {
+                ++count_outflow;
+                outflow.write(line);
+            }
+        }
+
+        void finish () {
+            inflow.close();
+            outflow.close();
+            fs::rename(inflow_path + ".tmp", inflow_path);
+            fs::rename(outflow_path + ".tmp", outflow_path);
+            filter.cache->save(path, [&](std::ostream &os) {
+                write_pod(os, count_in);
+                write_pod(os, count_inflow);
+                write_pod(os, count_outflow);
+                local_stock.write(os);
+            });
+            filter.merge(path, false, count_in, count_inflow, count_outflow, local_stock);
+        }
+    };
+
+public:
+    FilterConsumer (string const &datadir_): datadir(datadir_), stock(SURVEY_STOCK) {}
+
+    void start (vector<string> const &files) {
+        total_files = files.size();
+        fs::create_directory("data/filtered_inflow");
+        fs::create_directory("data/filtered_outflow");
+        fingerprint = {{"rules", FILTER_RULES}, {"slim", options::slim}, {"sample", options::sample},
+                       {"dedup", options::dedup}};
+        cache.reset(new Checkpoint("data/filter_cache", fingerprint.dump()));
+    }
+
+    std::unique_ptr<ScanConsumer::File> open (string const &path) {
+        if (!cache->done(path)) {
+            return std::unique_ptr<ScanConsumer::File>(new File(*this, path, cache->key(path)));
+        }
+        int count_in = 0;
+        int count_inflow = 0;
+        int count_outflow = 0;
+        Survey local_stock(SURVEY_STOCK);
+        cache->load(path, [&](std::istream &is) {
+            count_in = read_pod<int>(is);
+            count_inflow = read_pod<int>(is);
+            count_outflow = read_pod<int>(is);
+            local_stock.read(is);
+        });
+        merge(path, true, count_in, count_inflow, count_outflow, local_stock);
+        return nullptr;
+    }
+
+    void finish () {
+        cout << format("Total: {} => inflow {} / outflow {}, ratio = {:.4f} {:.4f}", total_in, total_inflow, total_outflow, 1.0 * total_inflow / total_in, 1.0 * total_outflow / total_in) << endl;
+        // drop outputs of inputs that changed or are gone; the keys of all
+        // inputs are known, so shards do not remove each other's outputs
+        unordered_set<string> keys;
+        for (auto const &path: list_files(datadir)) {
+            keys.insert(cache->key(path));
+        }
+        remove_stale("data/filtered_inflow", ".gz", keys);
+        remove_stale("data/filtered_outflow", ".gz", keys);
+        remove_stale("data/filter_cache", ".bin", keys);
+        std::sort(entries.begin(), entries.end(), [](json const &a, json const &b) {
+            return a["path"] < b["path"];
+        });
+        if (options::shard_count > 1) {
+            // do not clobber the stock and manifest of the other shards
+            write_stock_partial(format("data/stock_partial-{}-of-{}.bin", options::shard_index, options::shard_count), stock);
+            write_manifest(format("data/filter_manifest_{}_of_{}.json", options::shard_index, options::shard_count), fingerprint, entries);
+        }
+        else {
+            stock.save("data/stock");
+            write_manifest("data/filter_manifest.json", fingerprint, entries);
+        }
+    }
+};
+
+void filter_relevant (string const &datadir) {
+    FilterConsumer filter(datadir);
+    scan_authors(datadir, {&filter});
+}
+
+// Tracks the input bytes merged so far and, with --snapshot, periodically
+// publishes the merged results as <outdir>/snapshot, a symlink to a fully
+// written directory that is swapped atomically, so readers never see a
+// half-written snapshot.
+class Progress {
+    string outdir;
+    string stage;
+    uintmax_t total_bytes;
+    uintmax_t done_bytes;
+    int seq;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point last;
+
+    string version_dir (int n) const {
+        return format("{}/.snapshot.{}.{}", outdir, stage, n);
+    }
+public:
+    Progress (string const &outdir_, string const &stage_, vector<string> const &files)
+        : outdir(outdir_), stage(stage_), total_bytes(0), done_bytes(0), seq(0),
+          start(std::chrono::steady_clock::now()), last(start) {
+        for (auto const &path: files) total_bytes += fs::file_size(path);
+    }
+
+    double fraction () const {
+        return total_bytes > 0 ? 1.0 * done_bytes / total_bytes : 1.0;
+    }
+
+    // Called in the critical section right after a file is merged, so that
+    // save sees a consistent state.  save writes results under a directory
+    // with the same layout as outdir.
+    void update (string const &path, std::function<void(string const &)> const &save) {
+        done_bytes += fs::file_size(path);
+        if (options::snapshot <= 0) return;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last < std::chrono::seconds(options::snapshot)) return;
+        last = now;
+        string dir = version_dir(seq);
+        fs::remove_all(dir);
+        save(dir);
+        json progress;
+        progress["stage"] = stage;
+        progress["bytes_done"] = done_bytes;
+        progress["bytes_total"] = total_bytes;
+        progress["fraction"] = fraction();
+        progress["elapsed"] = std::chrono::duration<double>(now - start).count();
+        {
+            ofstream os(dir + "/progress.json");
+            os << progress.dump(2) << endl;
+        }
+        fs::path link(outdir + "/snapshot");
+        fs::path tmp(outdir + "/snapshot.tmp");
+        fs::remove(tmp);
+        fs::create_directory_symlink(fs::path(dir).filename(), tmp);
+        fs::rename(tmp, link);
+        // keep the previous version for readers that are still on it
+        if (seq >= 2) fs::remove_all(version_dir(seq - 2));
+        ++seq;
+        cout << format("Snapshot {} published: {:.4f} of input", seq, fraction()) << endl;
+    }
+
+    // the final results are in place, drop the snapshots
+    void finish () {
+        if (seq == 0) return;
+        fs::remove(outdir + "/snapshot");
+        for (int n = std::max(0, seq - 2); n < seq; ++n) {
+            fs::remove_all(version_dir(n));
+        }
+    }
+};
+
+// Spool of fixed size records produced inside a parallel loop.
+// Each thread appends to its own buffer without locking; a full buffer is
+// sorted and written to the thread's run file as one sorted run, so memory
+// stays at one block per thread however many records are produced.
+// merge() k-way merges all runs in T::operator< order, at most FAN_IN of
+// them at a time: while there are more, groups of FAN_IN runs are merged
+// into longer runs in a pass file, so the open files stay bounded.
+template <typename T>
+class RecordSpool {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static size_t constexpr FAN_IN = 128;
+    struct Run {
+        int file;           // run file of a thread, or a pass file after those
+        uint64_t offset;    // in records
+        uint64_t size;
+    };
+    struct Buffer {
+        vector<T> records;
+        ofstream os;
+        uint64_t written = 0;
+        vector<Run> runs;
+    };
+    string dir;
+    size_t block;
+    vector<std::unique_ptr<Buffer>> buffers;    // one per thread
+
+    string run_path (int file) const {
+        if (file < int(buffers.size())) return format("{}/{}.run", dir, file);
+        return format("{}/pass.{}.run", dir, file - int(buffers.size()));
+    }
+
+    void flush (int thread) {
+        Buffer &buf = *buffers[thread];
+        if (buf.records.empty()) return;
+        std::sort(buf.records.begin(), buf.records.end());
+        if (!buf.os.is_open()) {
+            buf.os.open(run_path(thread), std::ios::binary);
+            if (!buf.os) {
+                cerr << "Cannot write " << run_path(thread) << endl;
+                throw 0;
+            }
+        }
+        buf.os.write(reinterpret_cast<char const *>(&buf.records[0]), buf.records.size() * sizeof(T));
+        buf.runs.push_back({thread, buf.written, buf.records.size()});
+        buf.written += buf.records.size();
+        buf.records.clear();
+    }
+
+    // k-way merge of the given runs into f(record)
+    template <typename F>
+    void merge_runs (vector<Run> const &runs, F const &f) {
+        struct Cursor {
+            ifstream is;
+            uint64_t left;
+            T head;
+            bool next () {
+                if (left == 0) return false;
+                is.read(reinterpret_cast<char *>(&head), sizeof(T));
+                --left;
+                return bool(is);
+            }
+        };
+        vector<std::unique_ptr<Cursor>> cursors;
+        auto later = [&cursors](int a, int b) { return cursors[b]->head < cursors[a]->head; };
+        std::priority_queue<int, vector<int>, decltype(later)> heap(later);
+        for (auto const &run: runs) {
+            auto cursor = std::make_unique<Cursor>();
+            cursor->is.open(run_path(run.file), std::ios::binary);
+            if (!cursor->is) {
+                cerr << "Cannot open " << run_path(run.file) << endl;
+                throw 0;
+            }
+            cursor->is.seekg(run.offset * sizeof(T));
+            cursor->left = run.size;
+            if (!cursor->next()) throw 0;
+            cursors.push_back(std::move(cursor));
+            heap.push(cursors.size() - 1);
+        }
+        while (!heap.empty()) {
+            int c = heap.top();
+            heap.pop();
+            f(cursors[c]->head);
+            if (cursors[c]->next()) heap.push(c);
+        }
+    }
+
+public:
+    RecordSpool (string const &dir_, size_t block_ = 1 << 16)
+        : dir(dir_), block(block_) {
+        fs::create_directories(dir);
+        for (int i = 0; i < omp_get_max_threads(); ++i) {
+            buffers.emplace_back(new Buffer);
+            buffers.back()->records.reserve(block);
+        }
+    }
+
+    ~RecordSpool () {
+        buffers.clear();
+        fs::remove_all(dir);
+    }
+
+    void push (T const &record) {
+        int thread = omp_get_thread_num();
+        Buffer &buf = *buffers[thread];
+        buf.records.push_back(record);
+        if (buf.records.size() >= block) flush(thread);
+    }
+
+    uint64_t size () const {
+        uint64_t n = 0;
+        for (auto const &buf: buffers) n += buf->written + buf->records.size();
+        return n;
+    }
+
+    // Call f(record) for all records in sorted order.
+    // Must be called outside of the parallel region.
+    template <typename F>
+    void merge (F const &f) {
+        vector<Run> runs;
+        for (int i = 0; i < int(buffers.size()); ++i) {
+            flush(i);
+            buffers[i]->os.close();
+            vector<T>().swap(buffers[i]->records);     // the blocks are not needed any more
+            runs.insert(runs.end(), buffers[i]->runs.begin(), buffers[i]->runs.end());
+        }
+        for (int pass = 0; runs.size() > FAN_IN; ++pass) {
+            int file = buffers.size() + pass;
+            ofstream os(run_path(file), std::ios::binary);
+            vector<Run> merged;
+            uint64_t written = 0;
+            for (size_t i = 0; i < runs.size(); i += FAN_IN) {
+                vector<Run> group(runs.begin() + i, runs.begin() + std::min(runs.size(), i + FAN_IN));
+                uint64_t begin = written;
+                merge_runs(group, [&](T const &record) {
+                    os.write(reinterpret_cast<char const *>(&record), sizeof(T));
+                    ++written;
+                });
+                merged.push_back({file, begin, written - begin});
+            }
+            os.close();
+            if (!os) {
+                cerr << "Cannot write " << run_path(file) << endl;
+                throw 0;
+            }
+            if (pass > 0) fs::remove(run_path(file - 1));
+            runs.swap(merged);
+        }
+        merge_runs(runs, f);
+    }
+};
+
+// updated_date=YYYY-MM-DD in the path as YYYYMMDD, 0 if none
+uint32_t partition_date (string const &path) {
+    static string const KEY = "updated_date=";
+    size_t off = path.rfind(KEY);
+    if (off == string::npos) return 0;
+    uint32_t date = 0;
+    for (off += KEY.size(); off < path.size() && path[off] != '/'; ++off) {
+        if (std::isdigit(path[off])) date = date * 10 + (path[off] - '0');
+    }
+    return date;
+}
+
+void Dedup::build (string const &datadir) {
+    if (!options::dedup) return;
+    struct Entry {
+        int64_t id;
+        uint32_t date;
+        uint32_t file;
+        bool operator < (Entry const &other) const {
+            return std::tie(id, date, file) < std::tie(other.id, other.date, other.file);
+        }
+    };
+    // all files, also with --shard, so that every shard picks the same winners
+    vector<string> files = list_files(datadir);
+    file_index.clear();
+    winners.clear();
+    file_hashes.assign(files.size(), 0);
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        file_index[files[i]] = i;
+    }
+    RecordSpool<Entry> spool(format("data/.dedup_spool.{}", getpid()));
+    #pragma omp parallel for
+    for (size_t i = 0; i < files.size(); ++i) {
+        uint32_t date = partition_date(files[i]);
+        bxz::ifstream is(files[i]);
+        string line;
+        while (getline(is, line)) {
+            if (line.starts_with(SLIM_HEADER_KEY)) continue;
+            openalex_id_t id = peek_author_id(line);
+            if (id == INVALID_ID) {
+                try {
+                    id = extract_id(json::parse(line)["id"], Author::URL_PREFIX);
+                } catch (const json::exception& e) {
+                    continue;
+                }
+            }
+            spool.push({id, date, uint32_t(i)});
+        }
+    }
+    // entries of an ID are adjacent, the last one wins
+    uint64_t records = spool.size();
+    uint64_t superseded = 0;
+    Entry prev{INVALID_ID, 0, 0};
+    vector<uint32_t> group;     // files of the records of prev.id
+    auto close = [&]() {
+        if (group.size() < 2) return;
+        winners[prev.id] = prev.file;
+        for (uint32_t f: group) {
+            file_hashes[f] = mix64(file_hashes[f] ^ mix64(uint64_t(prev.id) * 2 + (f == prev.file)));
+        }
+    };
+    spool.merge([&](Entry const &e) {
+        if (e.id == prev.id) {
+            ++superseded;
+        }
+        else {
+            close();
+            group.clear();
+        }
+        group.push_back(e.file);
+        prev = e;
+    });
+    close();
+    cout << format("Dedup: {} records in {} files, {} superseded records of {} authors are skipped",
+                   records, files.size(), superseded, winners.size()) << endl;
+}
+
+// country to country transitions in each domain
+struct DomainTransitions: public Domain {
+    // Dim 0: 0 non-chinese, 1 chinese, 2 all
+    // Dim 1: year
+    // Dim 2: origin country
+    // Dim 3: destination country
+    xt::xtensor_fixed<int, xt::xshape<3, TOTAL_YEARS, NUM_COUNTRIES, NUM_COUNTRIES>> counts;
+    DomainTransitions (): Domain() { counts.fill(0); }
+
+    void add (int id, string const &name, int is_chinese, int year_offset, int origin_id, int destination_id, int delta = 1) {
+        if (this->display_name.empty()) {
+            this->id = id;
+            this->display_name = name;
+        }
+        else {
+            if (this->id != id) throw 0;
+        }
+        counts(is_chinese, year_offset, origin_id, destination_id) += delta;
+        counts(2, year_offset, origin_id, destination_id) += delta;
+    }
+
+    void merge (DomainTransitions const &other) {
+        add(other.id, other.display_name, 0, 0, 0, 0, 0);
+        counts += other.counts;
+    }
+};
+
+struct TransitionSurvey {
+    unordered_map<openalex_id_t, DomainTransitions> domains;
+
+    void add (Author const &author) {
+        int is_chinese = -1;
+        author.years.for_each_transition([&](int origin_id, int destination_id, int year_offset) {
+            if (is_chinese < 0) {
+                is_chinese = Surnames::is_chinese(author.display_name) ? 1 : 0;
+            }
+            for (auto const &[id, name] : author.domains) {
+                domains[id].add(id, name, is_chinese, year_offset, origin_id, destination_id);
+            }
+        });
+    }
+    void merge (TransitionSurvey const &other) {
+        for (auto const &[id, count] : other.domains) {
+            domains[id].merge(count);
+        }
+    }
+    void save (string const &path) const {
+       json meta;
+       meta["year_begin"] = YEAR_BEGIN;
+       meta["year_end"] = YEAR_END;
+       meta["countries"] = vector<string>(COUNTRY_CODES, COUNTRY_CODES + NUM_COUNTRIES);
+       json jdomains = json::array();
+       xt::xtensor<int, 5> counts;
+       counts.resize({domains.size(), 3, TOTAL_YEARS, NUM_COUNTRIES, NUM_COUNTRIES});
+       int i = 0;
+       for (auto const &[id, domain]: domains) {
+           jdomains.push_back({{"id", domain.id},
+                               {"display_name", domain.display_name}});
+           xt::view(counts, i, xt::all(), xt::all(), xt::all(), xt::all()) = domain.counts;
+           ++i;
+       }
+       meta["domains"] = jdomains;
+       Sampler::describe(&meta);
+       fs::create_directories(path);
+       ofstream os(path + "/meta.json");
+       os << meta.dump(2) << endl;
+       dump_counts(path + "/counts", counts);
+    }
+};
+
+// Origin-destination matrices of all countries in one scan of the
+// unfiltered data; the filtered directories only hold US movers.
+class TransitionConsumer: public ScanConsumer {
+    string outdir;
+    TransitionSurvey survey;
+    std::unique_ptr<Progress> progress;
+    size_t total_files = 0;
+    int done = 0;
+
+    class File: public ScanConsumer::File {
+        TransitionConsumer &owner;
+        string path;
+        TransitionSurvey local;
+    public:
+        File (TransitionConsumer &owner_, string const &path_): owner(owner_), path(path_) {}
+
+        void add (AuthorRecord &record) {
+            local.add(record.author());
+        }
+
+        void finish () {
+            #pragma omp critical
+            {
+                owner.survey.merge(local);
+                ++owner.done;
+                owner.progress->update(path, [&](string const &dir) {
+                    owner.survey.save(dir + "/transitions");
+                });
+                cout << format("Processed {}/{}", owner.done, owner.total_files) << endl;
+            }
+        }
+    };
+
+public:
+    TransitionConsumer (string const &outdir_): outdir(outdir_) {}
+
+    void start (vector<string> const &files) {
+        total_files = files.size();
+        fs::create_directories(outdir);
+        progress.reset(new Progress(outdir, "transitions", files));
+    }
+
+    std::unique_ptr<ScanConsumer::File> open (string const &path) {
+        return std::unique_ptr<ScanConsumer::File>(new File(*this, path));
+    }
+
+    void finish () {
+        survey.save(outdir + "/transitions");
+        progress->finish();
+    }
+};
+
+void count_transitions (string const &datadir, string const &outdir) {
+    TransitionConsumer transitions(outdir);
+    scan_authors(datadir, {&transitions});
+}
+
+// numpy type descriptors of the column types
+template <typename T> char const *npy_descr ();
+template <> char const *npy_descr<int64_t> () { return "<i8"; }
+template <> char const *npy_descr<int32_t> () { return "<i4"; }
+template <> char const *npy_descr<uint32_t> () { return "<u4"; }
+template <> char const *npy_descr<uint8_t> () { return "|u1"; }
+
+// Streams a 1-D .npy column whose length is known in advance, so the
+// column never has to be held in memory.
+template <typename T>
+class NpyColumnWriter {
+    string path;
+    vector<char> buffer;
+    ofstream os;
+public:
+    NpyColumnWriter (string const &path_, uint64_t size): path(path_), buffer(1 << 20) {
+        os.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+        os.open(path, std::ios::binary);
+        string header = format("{{'descr': '{}', 'fortran_order': False, 'shape': ({},), }}", npy_descr<T>(), size);
+        // magic (6) + version (2) + header length (2) + header, padded to 64
+        size_t total = (10 + header.size() + 1 + 63) / 64 * 64;
+        header.append(total - 10 - header.size() - 1, ' ');
+        header.push_back('\n');
+        uint16_t len = header.size();
+        os.write("\x93NUMPY\x01\x00", 8);
+        os.write(reinterpret_cast<char const *>(&len), 2);
+        os.write(header.data(), header.size());
+    }
+
+    void push (T value) {
+        os.write(reinterpret_cast<char const *>(&value), sizeof(T));
+    }
+
+    // throws if anything failed to be written
+    void close () {
+        os.close();
+        if (!os) {
+            cerr << "Failed to write " << path << endl;
+            throw 0;
+        }
+    }
+};
+
+// Read-only memory map of a 1-D .npy column written by NpyColumnWriter
+// (or numpy.save of a contiguous 1-D array).
+template <typename T>
+class NpyColumn {
+    void *base;
+    size_t length;
+    T const *values;
+    size_t count;
+public:
+    NpyColumn (string const &path): base(MAP_FAILED), length(0), values(nullptr), count(0) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Cannot open " << path << endl;
+            throw 0;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        length = st.st_size;
+        base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED || length < 10) {
+            cerr << "Cannot map " << path << endl;
+            throw 0;
+        }
+        char const *p = static_cast<char const *>(base);
+        if (memcmp(p, "\x93NUMPY", 6) != 0 || p[6] != 1) {
+            cerr << "Not a version 1 npy file: " << path << endl;
+            throw 0;
+        }
+        uint16_t len;
+        memcpy(&len, p + 8, 2);
+        string header(p + 10, len);
+        string descr = format("'descr': '{}'", npy_descr<T>());
+        size_t shape = header.find("'shape': (");
+        if (header.find(descr) == string::npos || shape == string::npos
+                || header.find("'fortran_order': False") == string::npos) {
+            cerr << "Unexpected npy header in " << path << ": " << header << endl;
+            throw 0;
+        }
+        count = std::stoull(header.substr(shape + 10));
+        values = reinterpret_cast<T const *>(p + 10 + len);
+        if (10 + len + count * sizeof(T) > length) {
+            cerr << "Truncated npy file: " << path << endl;
+            throw 0;
+        }
+    }
+
+    ~NpyColumn () {
+        if (base != MAP_FAILED) munmap(base, length);
+    }
+
+    NpyColumn (NpyColumn const &) = delete;
+    NpyColumn &operator = (NpyColumn const &) = delete;
+
+    size_t size () const { return count; }
+    T const *begin () const { return values; }
+    T const *end () const { return values + count; }
+    T operator [] (size_t i) const { return values[i]; }
+};
+
+// Set of author IDs as a Roaring style compressed bitmap.  An ID is split
+// into its high bits, which select a container, and its low 16 bits,
+// kept in the container as a sorted array while it holds at most
+// ARRAY_MAX of them and as a 65536-bit bitmap once it is denser.  A lookup
+// is a binary search over the container keys, then an array search or a
+// bit test.  Saved as "AAIDSET1", the number of containers and IDs, then
+// per container its key, kind (0 array, 1 bitmap), length and payload.
+char const ID_SET_MAGIC[] = "AAIDSET1";
+
+class AuthorIdSet {
+    static int constexpr LOW_BITS = 16;
+    static size_t constexpr ARRAY_MAX = 4096;
+    static size_t constexpr BITMAP_WORDS = (size_t(1) << LOW_BITS) / 64;
+    struct Container {
+        uint64_t key;
+        vector<uint16_t> array;     // used if bitmap is empty
+        vector<uint64_t> bitmap;
+    };
+    vector<Container> containers;   // sorted by key
+    size_t count = 0;
+
+    void build (vector<int64_t> ids) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        containers.clear();
+        count = 0;
+        size_t i = 0;
+        while (i < ids.size() && ids[i] < 0) ++i;   // INVALID_ID
+        while (i < ids.size()) {
+            uint64_t key = uint64_t(ids[i]) >> LOW_BITS;
+            size_t end = i;
+            while (end < ids.size() && (uint64_t(ids[end]) >> LOW_BITS) == key) ++end;
+            Container c;
+            c.key = key;
+            if (end - i <= ARRAY_MAX) {
+                for (size_t k = i; k < end; ++k) c.array.push_back(uint16_t(ids[k]));
+            }
+            else {
+                c.bitmap.resize(BITMAP_WORDS, 0);
+                for (size_t k = i; k < end; ++k) {
+                    uint16_t low = uint16_t(ids[k]);
+                    c.bitmap[low >> 6] |= uint64_t(1) << (low & 63);
+                }
+            }
+            containers.push_back(std::move(c));
+            count += end - i;
+            i = end;
+        }
+    }
+
+public:
+    AuthorIdSet () {}
+
+    explicit AuthorIdSet (vector<int64_t> const &ids) { build(ids); }
+
+    // From a records directory (its author_id.npy), a saved set, or a CSV
+    // whose first column is the author ID, after a header line.
+    static AuthorIdSet load (string const &path) {
+        AuthorIdSet set;
+        vector<int64_t> ids;
+        if (fs::is_directory(path)) {
+            // columnar records, e.g. <out_dir>/outflow_records
+            NpyColumn<int64_t> column(path + "/author_id.npy");
+            ids.assign(column.begin(), column.end());
+            set.build(ids);
+            return set;
+        }
+        ifstream is(path, std::ios::binary);
+        if (!is) {
+            cerr << "Cannot open " << path << endl;
+            throw 0;
+        }
+        char magic[8] = {0};
+        is.read(magic, sizeof(magic));
+        if (is && memcmp(magic, ID_SET_MAGIC, sizeof(magic)) == 0) {
+            // the containers must be what build makes, or contains would
+            // give wrong answers instead of failing
+            auto invalid = [&path](string const &why) {
+                cerr << "Invalid ID set " << path << ": " << why << endl;
+                throw 0;
+            };
+            uint64_t n = read_pod<uint64_t>(is);
+            uint64_t expected = read_pod<uint64_t>(is);
+            for (uint64_t k = 0; k < n; ++k) {
+                Container c;
+                c.key = read_pod<uint64_t>(is);
+                uint32_t kind = read_pod<uint32_t>(is);
+                uint32_t len = read_pod<uint32_t>(is);
+                if (!is) break;
+                if (c.key > (uint64_t(INT64_MAX) >> LOW_BITS)) invalid("key out of range");
+                if (!set.containers.empty() && c.key <= set.containers.back().key) invalid("keys not increasing");
+                if (kind == 0) {
+                    if (len == 0 || len > ARRAY_MAX) invalid(format("array of {} values", len));
+                    c.array.resize(len);
+                    is.read(reinterpret_cast<char *>(c.array.data()), len * sizeof(uint16_t));
+                    if (!is) break;
+                    for (uint32_t v = 1; v < len; ++v) {
+                        if (c.array[v] <= c.array[v - 1]) invalid("array values not increasing");
+                    }
+                    set.count += len;
+                }
+                else if (kind == 1) {
+                    if (len != BITMAP_WORDS) invalid(format("bitmap of {} words", len));
+                    c.bitmap.resize(len);
+                    is.read(reinterpret_cast<char *>(c.bitmap.data()), len * sizeof(uint64_t));
+                    for (uint64_t w: c.bitmap) set.count += __builtin_popcountll(w);
+                }
+                else {
+                    invalid(format("container kind {}", kind));
+                }
+                if (!is) break;
+                set.containers.push_back(std::move(c));
+            }
+            if (!is) {
+                cerr << "Truncated ID set: " << path << endl;
+                throw 0;
+            }
+            if (set.count != expected) invalid(format("{} IDs, header says {}", set.count, expected));
+            return set;
+        }
+        is.clear();
+        is.seekg(0);
+        string line;
+        // Skip header
+        getline(is, line);
+        while (getline(is, line)) {
+            size_t pos = line.find(',');
+            if (pos != string::npos) {
+                ids.push_back(stoll(line.substr(0, pos)));
+            }
+        }
+        set.build(ids);
+        return set;
+    }
+
+    void save (string const &path) const {
+        string tmp = path + ".tmp";
+        {
+            ofstream os(tmp, std::ios::binary);
+            os.write(ID_SET_MAGIC, 8);
+            write_pod<uint64_t>(os, containers.size());
+            write_pod<uint64_t>(os, count);
+            for (auto const &c: containers) {
+                write_pod<uint64_t>(os, c.key);
+                write_pod<uint32_t>(os, c.bitmap.empty() ? 0 : 1);
+                if (c.bitmap.empty()) {
+                    write_pod<uint32_t>(os, c.array.size());
+                    os.write(reinterpret_cast<char const *>(c.array.data()), c.array.size() * sizeof(uint16_t));
+                }
+                else {
+                    write_pod<uint32_t>(os, c.bitmap.size());
+                    os.write(reinterpret_cast<char const *>(c.bitmap.data()), c.bitmap.size() * sizeof(uint64_t));
+                }
+            }
+            if (!os) {
+                cerr << "Failed to write " << tmp << endl;
+                throw 0;
+            }
+        }
+        fs::rename(tmp, path);
+    }
+
+    bool empty () const { return count == 0; }
+    size_t size () const { return count; }
+    size_t container_count () const { return containers.size(); }
+
+    // changes with the set, for checkpoint keys
+    uint64_t hash () const {
+        uint64_t h = mix64(count);
+        for (auto const &c: containers) {
+            h = mix64(h ^ c.key);
+            for (uint16_t v: c.array) h = mix64(h ^ v);
+            for (uint64_t w: c.bitmap) h = mix64(h ^ w);
+        }
+        return h;
+    }
+
+    bool contains (int64_t id) const {
+        if (id < 0) return false;
+        uint64_t key = uint64_t(id) >> LOW_BITS;
+        uint16_t low = uint16_t(id);
+        auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                                   [](Container const &c, uint64_t key) { return c.key < key; });
+        if (it == containers.end() || it->key != key) return false;
+        if (!it->bitmap.empty()) return (it->bitmap[low >> 6] >> (low & 63)) & 1;
+        return std::binary_search(it->array.begin(), it->array.end(), low);
+    }
+};
+
+// Domains of an author as a 32-bit mask: EnCS (-2) is bit 0, All (-1)
+// bit 1, OpenAlex domain n bit n + 2.
+inline int domain_bit (openalex_id_t domain_id) {
+    return int(domain_id - EnCS_DOMAIN_ID);
+}
+
+uint32_t domain_mask (Author const &author) {
+    uint32_t mask = 0;
+    for (auto const &[id, name] : author.domains) {
+        int bit = domain_bit(id);
+        if (bit >= 0 && bit < 32) mask |= 1u << bit;
+    }
+    return mask;
+}
+
+struct Outflow {
+    int64_t author_id;
+    int32_t year;
+    uint8_t destination;    // country ID
+    uint8_t is_chinese;
+    uint8_t is_experienced;
+    uint32_t domains;       // domain_mask
+
+    // serialized field by field: the struct has padding, which brace
+    // initialization leaves undefined, and its layout is the ABI's
+    static int constexpr FORMAT = 2;
+
+    void write (std::ostream &os) const {
+        write_pod(os, author_id);
+        write_pod(os, year);
+        write_pod(os, destination);
+        write_pod(os, is_chinese);
+        write_pod(os, is_experienced);
+        write_pod(os, domains);
+    }
+
+    static Outflow read (std::istream &is) {
+        Outflow o;
+        o.author_id = read_pod<int64_t>(is);
+        o.year = read_pod<int32_t>(is);
+        o.destination = read_pod<uint8_t>(is);
+        o.is_chinese = read_pod<uint8_t>(is);
+        o.is_experienced = read_pod<uint8_t>(is);
+        o.domains = read_pod<uint32_t>(is);
+        return o;
+    }
+
+    bool operator < (Outflow const &other) const {
+        return author_id < other.author_id;
+    }
+};
+
+// Write the per-author records as typed columns, one .npy per field under
+// <outdir>/outflow_records, which numpy.load(..., mmap_mode='r') and
+// NpyColumn map without parsing.  With --csv also write outflow.txt.
+void save_outflow_records (string const &outdir, RecordSpool<Outflow> &outflows, Survey const &survey) {
+    string dir = outdir + "/outflow_records";
+    fs::create_directories(dir);
+    uint64_t size = outflows.size();
+    json meta;
+    meta["size"] = size;
+    meta["columns"] = {{{"name", "author_id"}, {"dtype", npy_descr<int64_t>()}},
+                       {{"name", "year"}, {"dtype", npy_descr<int32_t>()}},
+                       {{"name", "destination"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "is_chinese"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "is_experienced"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "domains"}, {"dtype", npy_descr<uint32_t>()}}};
+    meta["countries"] = vector<string>(COUNTRY_CODES, COUNTRY_CODES + NUM_COUNTRIES);
+    json jdomains = json::array();
+    for (auto const &[id, domain]: survey.domains) {
+        jdomains.push_back({{"bit", domain_bit(id)},
+                            {"id", id},
+                            {"display_name", domain.display_name}});
+    }
+    meta["domain_bits"] = jdomains;
+    {
+        ofstream os(dir + "/meta.json");
+        os << meta.dump(2) << endl;
+    }
+    NpyColumnWriter<int64_t> author_id(dir + "/author_id.npy", size);
+    NpyColumnWriter<int32_t> year(dir + "/year.npy", size);
+    NpyColumnWriter<uint8_t> destination(dir + "/destination.npy", size);
+    NpyColumnWriter<uint8_t> is_chinese(dir + "/is_chinese.npy", size);
+    NpyColumnWriter<uint8_t> is_experienced(dir + "/is_experienced.npy", size);
+    NpyColumnWriter<uint32_t> domains(dir + "/domains.npy", size);
+    vector<char> os_buffer(1 << 20);
+    ofstream os;
+    if (options::csv) {
+        os.rdbuf()->pubsetbuf(&os_buffer[0], os_buffer.size());
+        os.open(outdir + "/outflow.txt");
+        os << "author_id,year,destination,is_chinese,is_experienced,domains\n";
+    }
+    outflows.merge([&](Outflow const &o) {
+        author_id.push(o.author_id);
+        year.push(o.year);
+        destination.push(o.destination);
+        is_chinese.push(o.is_chinese);
+        is_experienced.push(o.is_experienced);
+        domains.push(o.domains);
+        if (options::csv) {
+            os << o.author_id << "," << o.year << "," << COUNTRY_CODES[o.destination] << ","
+               << int(o.is_chinese) << "," << int(o.is_experienced) << "," << o.domains << '\n';
+        }
+    });
+}
+
+// Results of count: the surveys and the per-author outflow records.
+// With --shard, a process writes them as a binary partial and the merge
+// subcommand combines any number of partials into the final outputs.
+char const PARTIAL_MAGIC[] = "AAPART02";
+
+struct CountResult {
+    Survey inflow;
+    Survey outflow;
+    Survey outflow_experienced;
+    Survey outflow_not_experienced;
+    RecordSpool<Outflow> outflows;
+    bool has_inflow;    // count_filtered only does the outflow
+    int partials;       // number of partials read
+
+    CountResult (string const &outdir)
+        : inflow(SURVEY_INFLOW),
+          outflow(SURVEY_OUTFLOW),
+          outflow_experienced(SURVEY_OUTFLOW_EXPERIENCED),
+          outflow_not_experienced(SURVEY_OUTFLOW_NOT_EXPERIENCED),
+          outflows(format("{}/.outflow_spool.{}", outdir, getpid())),
+          has_inflow(false),
+          partials(0) {
+    }
+
+    void save_surveys (string const &outdir) const {
+        if (has_inflow) inflow.save(outdir + "/inflow");
+        outflow.save(outdir + "/outflow");
+        outflow_experienced.save(outdir + "/outflow_experienced");
+        outflow_not_experienced.save(outdir + "/outflow_not_experienced");
+    }
+
+    void save (string const &outdir) {
+        save_surveys(outdir);
+        save_outflow_records(outdir, outflows, outflow);
+    }
+
+    void write_partial (string const &path) {
+        json header;
+        header["shard_index"] = options::shard_index;
+        header["shard_count"] = options::shard_count;
+        header["sample"] = options::sample;
+        header["bootstrap"] = options::bootstrap;
+        header["has_inflow"] = has_inflow;
+        header["bad_json"] = errors::bad_json.load();
+        header["invalid_id"] = errors::invalid_id.load();
+        header["outflows"] = outflows.size();
+        string tmp = path + ".tmp";
+        {
+            ofstream os(tmp, std::ios::binary);
+            os.write(PARTIAL_MAGIC, 8);
+            write_string(os, header.dump());
+            inflow.write(os);
+            outflow.write(os);
+            outflow_experienced.write(os);
+            outflow_not_experienced.write(os);
+            outflows.merge([&os](Outflow const &o) {
+                o.write(os);
+            });
+            if (!os) {
+                cerr << "Failed to write " << tmp << endl;
+                throw 0;
+            }
+        }
+        fs::rename(tmp, path);
+    }
+
+    // merge a partial written by write_partial into this result
+    void read_partial (string const &path) {
+        ifstream is(path, std::ios::binary);
+        char magic[8];
+        is.read(magic, 8);
+        if (!is || memcmp(magic, PARTIAL_MAGIC, 8) != 0) {
+            cerr << "Not a partial result: " << path << endl;
+            throw 0;
+        }
+        json header = json::parse(read_string(is));
+        if (partials == 0) {
+            // the final outputs are scaled and banded like the shards
+            Sampler::set_rate(header["sample"].get<double>());
+            options::bootstrap = header["bootstrap"];
+        }
+        else if (header["sample"].get<double>() != options::sample
+                || header["bootstrap"].get<int>() != options::bootstrap) {
+            cerr << "Partial " << path << " was made with other --sample / --bootstrap options" << endl;
+            throw 0;
+        }
+        ++partials;
+        has_inflow = has_inflow || header["has_inflow"].get<bool>();
+        errors::bad_json += header["bad_json"].get<int>();
+        errors::invalid_id += header["invalid_id"].get<int>();
+        inflow.read(is);
+        outflow.read(is);
+        outflow_experienced.read(is);
+        outflow_not_experienced.read(is);
+        size_t n = header["outflows"];
+        for (size_t i = 0; i < n; ++i) {
+            outflows.push(Outflow::read(is));
+        }
+    }
+};
+
+// What the count checkpoints depend on besides their input file, so that
+// a --resume with other options or another ID set starts over.
+string count_fingerprint (AuthorIdSet const *filter) {
+    json fingerprint = {{"rules", COUNT_RULES}, {"sample", options::sample}, {"bootstrap", options::bootstrap},
+                        {"dedup", options::dedup}, {"outflow_format", Outflow::FORMAT},
+                        {"filter", filter && !filter->empty() ? format("{:016x}", filter->hash()) : ""}};
+    return fingerprint.dump();
+}
+
+void count_migration_inflow (string const &datadir, string const &outdir, CountResult *result) {
+    vector<string> files;
+    scan_files(datadir, &files);
+    cout << "Found " << files.size() << " files" << endl;
+    int done = 0;
+    fs::create_directories(outdir);
+    Progress progress(outdir, "inflow", files);
+    Checkpoint checkpoint(checkpoint_dir(outdir, "inflow"), count_fingerprint(nullptr), false);
+    #pragma omp parallel for
+    for (size_t i = 0; i < files.size(); ++i) {
+        Survey local(SURVEY_INFLOW);
+        if (checkpoint.done(files[i])) {
+            checkpoint.load(files[i], [&](std::istream &is) {
+                local.read(is);
+            });
+        }
+        else {
+            AuthorReader reader(files[i]);
+            string line;
+            while (reader.next(&line)) {
+                try {
+                    Author author(json::parse(line));
+                    local.add(author);
+                } catch (const json::exception& e) {
+                    errors::bad_json += 1;
+                }
+            }
+            checkpoint.save(files[i], [&](std::ostream &os) {
+                local.write(os);
+            });
+        }
+        #pragma omp critical
+        {
+            result->inflow.merge(local);
+            ++done;
+            progress.update(files[i], [&](string const &dir) {
+                result->inflow.save(dir + "/inflow");
+            });
+            cout << format("Processed {}/{}", done, files.size()) << endl;
+        }
+    }
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+    result->has_inflow = true;
+    progress.finish();
+}
+
+void count_migration_outflow (string const &datadir, string const &outdir,
+                              AuthorIdSet const &filter, CountResult *result) {
+    vector<string> files;
+    scan_files(datadir, &files);
+    cout << "Found " << files.size() << " files" << endl;
+    int done = 0;
+    fs::create_directories(outdir);
+    Progress progress(outdir, "outflow", files);
+    // a filtered run has different partial results
+    Checkpoint checkpoint(checkpoint_dir(outdir, filter.empty() ? "outflow" : "outflow_filtered"),
+                          count_fingerprint(&filter), false);
+    #pragma omp parallel for
+    for (size_t i = 0; i < files.size(); ++i) {
+        Survey local(SURVEY_OUTFLOW);
+        Survey local_experienced(SURVEY_OUTFLOW_EXPERIENCED);
+        Survey local_not_experienced(SURVEY_OUTFLOW_NOT_EXPERIENCED);
+        vector<Outflow> records;
+        if (checkpoint.done(files[i])) {
+            checkpoint.load(files[i], [&](std::istream &is) {
+                local.read(is);
+                local_experienced.read(is);
+                local_not_experienced.read(is);
+                records.resize(read_pod<uint64_t>(is));
+                for (auto &rec: records) rec = Outflow::read(is);
+            });
+        }
+        else {
+            AuthorReader reader(files[i]);
+            string line;
+            while (reader.next(&line)) {
+                if (!filter.empty()) {
+                    // skip non-members before parsing; lines whose ID
+                    // cannot be peeked are checked after parsing
+                    openalex_id_t id = peek_author_id(line);
+                    if (id != INVALID_ID && !filter.contains(id)) continue;
+                }
+                try {
+                    Author author(json::parse(line));
+                    if (!filter.empty()) {
+                        if (!filter.contains(author.id)) continue;
+                    }
+                    Migration mig = author.years.get_migration(SURVEY_OUTFLOW);
+                    if (mig.year_offset >= 0) {
+                        int is_chinese = Surnames::is_chinese(author.display_name) ? 1 : 0;
+                        int is_experienced = author.works_count >= EXPERIENCED_THRESHOLD ? 1 : 0;
+                        records.push_back({author.id, mig.year_offset + YEAR_BEGIN, uint8_t(mig.country_id),
+                                           uint8_t(is_chinese), uint8_t(is_experienced), domain_mask(author)});
+                    }
+                    local.add(author);
+                    local_experienced.add(author);
+                    local_not_experienced.add(author);
+                } catch (const json::exception& e) {
+                    errors::bad_json += 1;
+                }
+            }
+            checkpoint.save(files[i], [&](std::ostream &os) {
+                local.write(os);
+                local_experienced.write(os);
+                local_not_experienced.write(os);
+                write_pod(os, uint64_t(records.size()));
+                for (auto const &rec: records) rec.write(os);
+            });
+        }
+        for (auto const &rec: records) {
+            result->outflows.push(rec);
+        }
+        #pragma omp critical
+        {
+            result->outflow.merge(local);
+            result->outflow_experienced.merge(local_experienced);
+            result->outflow_not_experienced.merge(local_not_experienced);
+            ++done;
+            progress.update(files[i], [&](string const &dir) {
+                result->save_surveys(dir);
+            });
             cout << format("Processed {}/{}", done, files.size()) << endl;
         }
     }
-    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
-    survey.save(outdir + "/inflow");
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+    progress.finish();
+}
+
+// Incremental counting over the raw author partitions.  The ledger keeps,
+// for every author record with a migration, the cells it added and the
+// input file it came from.  When a release rewrites or drops some
+// partitions, update retracts the contributions of those files and scans
+// only the new and changed ones, giving the counts of filter + count over
+// the whole snapshot.
+char const LEDGER_MAGIC[] = "AALEDG02";
+
+struct Contribution {
+    int64_t author_id;
+    uint32_t file;          // index into the file table of the ledger
+    uint32_t domains;       // domain_mask
+    int8_t inflow_year;     // year offsets, -1 if no migration
+    uint8_t inflow_country;
+    int8_t outflow_year;
+    uint8_t outflow_country;
+    uint8_t is_chinese;
+    uint8_t is_experienced;
+
+    // field by field, like Outflow, so that no padding reaches the ledger
+    void write (std::ostream &os) const {
+        write_pod(os, author_id);
+        write_pod(os, file);
+        write_pod(os, domains);
+        write_pod(os, inflow_year);
+        write_pod(os, inflow_country);
+        write_pod(os, outflow_year);
+        write_pod(os, outflow_country);
+        write_pod(os, is_chinese);
+        write_pod(os, is_experienced);
+    }
+
+    static Contribution read (std::istream &is) {
+        Contribution c;
+        c.author_id = read_pod<int64_t>(is);
+        c.file = read_pod<uint32_t>(is);
+        c.domains = read_pod<uint32_t>(is);
+        c.inflow_year = read_pod<int8_t>(is);
+        c.inflow_country = read_pod<uint8_t>(is);
+        c.outflow_year = read_pod<int8_t>(is);
+        c.outflow_country = read_pod<uint8_t>(is);
+        c.is_chinese = read_pod<uint8_t>(is);
+        c.is_experienced = read_pod<uint8_t>(is);
+        return c;
+    }
+
+    bool operator < (Contribution const &other) const {
+        return author_id < other.author_id;
+    }
+
+    Outflow outflow () const {
+        return {author_id, outflow_year + YEAR_BEGIN, outflow_country, is_chinese, is_experienced, domains};
+    }
+};
+
+// retract (delta = -1) a contribution from the surveys; false if the
+// surveys do not match the ledger
+bool apply_contribution (Contribution const &c, int delta, CountResult *result) {
+    bool ok = true;
+    if (c.inflow_year >= 0) {
+        ok &= result->inflow.add_cells(c.author_id, c.domains, c.is_chinese, c.inflow_year, c.inflow_country, delta);
+    }
+    if (c.outflow_year >= 0) {
+        ok &= result->outflow.add_cells(c.author_id, c.domains, c.is_chinese, c.outflow_year, c.outflow_country, delta);
+        Survey &split = c.is_experienced ? result->outflow_experienced : result->outflow_not_experienced;
+        ok &= split.add_cells(c.author_id, c.domains, c.is_chinese, c.outflow_year, c.outflow_country, delta);
+    }
+    return ok;
+}
+
+void update_counts (string const &datadir, string const &outdir) {
+    if (options::shard_count > 1 || options::dedup) {
+        // a ledger entry must only depend on the records of its own file
+        cerr << "update does not support --shard or --dedup" << endl;
+        throw 0;
+    }
+    fs::create_directories(outdir);
+    string ledger_path = outdir + "/ledger.bin";
+    CountResult result(outdir);
+    result.has_inflow = true;
+    json old_files = json::array();
+    uint64_t old_size = 0;
+    ifstream is(ledger_path, std::ios::binary);
+    if (is) {
+        char magic[8];
+        is.read(magic, 8);
+        if (!is || memcmp(magic, LEDGER_MAGIC, 8) != 0) {
+            cerr << "Not a ledger: " << ledger_path << endl;
+            throw 0;
+        }
+        json header = json::parse(read_string(is));
+        if (header["sample"].get<double>() != options::sample
+                || header["bootstrap"].get<int>() != options::bootstrap) {
+            cerr << "The ledger was made with other --sample / --bootstrap options" << endl;
+            throw 0;
+        }
+        old_files = header["files"];
+        old_size = header["size"];
+        result.inflow.read(is);
+        result.outflow.read(is);
+        result.outflow_experienced.read(is);
+        result.outflow_not_experienced.read(is);
+    }
+
+    vector<string> files;
+    scan_files(datadir, &files);
+    json new_files = json::array();
+    unordered_map<string, uint32_t> current;
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        new_files.push_back(file_identity(files[i]));
+        current[files[i]] = i;
+    }
+    // old file index -> new index, -1 if the file changed or is gone
+    vector<int64_t> remap(old_files.size(), -1);
+    vector<bool> unchanged(files.size(), false);
+    for (size_t i = 0; i < old_files.size(); ++i) {
+        auto it = current.find(old_files[i]["path"].get<string>());
+        if (it != current.end() && new_files[it->second] == old_files[i]) {
+            remap[i] = it->second;
+            unchanged[it->second] = true;
+        }
+    }
+
+    RecordSpool<Contribution> ledger(format("{}/.ledger_spool.{}", outdir, getpid()));
+    size_t retracted = 0;
+    // records that do not fit the ledger; the update fails after the scan
+    std::atomic<int> mismatches = 0;
+    for (uint64_t i = 0; i < old_size; ++i) {
+        Contribution c = Contribution::read(is);
+        if (remap[c.file] < 0) {
+            if (!apply_contribution(c, -1, &result)) ++mismatches;
+            ++retracted;
+            continue;
+        }
+        c.file = remap[c.file];
+        ledger.push(c);
+        if (c.outflow_year >= 0) result.outflows.push(c.outflow());
+    }
+    is.close();
+    result.inflow.prune();
+    result.outflow.prune();
+    result.outflow_experienced.prune();
+    result.outflow_not_experienced.prune();
+
+    vector<uint32_t> todo;
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        if (!unchanged[i]) todo.push_back(i);
+    }
+    cout << format("{} of {} files new or changed, {} contributions retracted", todo.size(), files.size(), retracted) << endl;
+    int done = 0;
+    #pragma omp parallel for
+    for (size_t k = 0; k < todo.size(); ++k) {
+        uint32_t file = todo[k];
+        AuthorReader reader(files[file]);
+        string line;
+        Survey inflow(SURVEY_INFLOW);
+        Survey outflow(SURVEY_OUTFLOW);
+        Survey outflow_experienced(SURVEY_OUTFLOW_EXPERIENCED);
+        Survey outflow_not_experienced(SURVEY_OUTFLOW_NOT_EXPERIENCED);
+        vector<Contribution> contributions;
+        while (reader.next(&line)) {
+            try {
+                Author author(json::parse(line));
+                Migration in = author.years.get_migration_inflow();
+                Migration out = author.years.get_migration_outflow();
+                if (in.year_offset < 0 && out.year_offset < 0) continue;
+                uint32_t mask = domain_mask(author);
+                if (__builtin_popcount(mask) != author.domains.size()) {
+                    #pragma omp critical
+                    cerr << "Domain of author " << author.id << " does not fit the ledger" << endl;
+                    ++mismatches;
+                    continue;
+                }
+                Contribution c{author.id, file, mask,
+                               int8_t(in.year_offset), uint8_t(in.country_id),
+                               int8_t(out.year_offset), uint8_t(out.country_id),
+                               uint8_t(Surnames::is_chinese(author.display_name) ? 1 : 0),
+                               uint8_t(author.works_count >= EXPERIENCED_THRESHOLD ? 1 : 0)};
+                inflow.add(author);
+                outflow.add(author);
+                outflow_experienced.add(author);
+                outflow_not_experienced.add(author);
+                contributions.push_back(c);
+            } catch (const json::exception& e) {
+                errors::bad_json += 1;
+            }
+        }
+        for (auto const &c: contributions) {
+            ledger.push(c);
+            if (c.outflow_year >= 0) result.outflows.push(c.outflow());
+        }
+        #pragma omp critical
+        {
+            result.inflow.merge(inflow);
+            result.outflow.merge(outflow);
+            result.outflow_experienced.merge(outflow_experienced);
+            result.outflow_not_experienced.merge(outflow_not_experienced);
+            ++done;
+            cout << format("Processed {}/{}", done, todo.size()) << endl;
+        }
+    }
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+    if (mismatches > 0) {
+        // the old ledger is left in place
+        cerr << format("{} records do not fit the ledger, nothing written", mismatches.load()) << endl;
+        throw 0;
+    }
+
+    json header;
+    header["files"] = new_files;
+    header["size"] = ledger.size();
+    header["sample"] = options::sample;
+    header["bootstrap"] = options::bootstrap;
+    string tmp = ledger_path + ".tmp";
+    {
+        ofstream os(tmp, std::ios::binary);
+        os.write(LEDGER_MAGIC, 8);
+        write_string(os, header.dump());
+        result.inflow.write(os);
+        result.outflow.write(os);
+        result.outflow_experienced.write(os);
+        result.outflow_not_experienced.write(os);
+        ledger.merge([&os](Contribution const &c) {
+            c.write(os);
+        });
+        if (!os) {
+            cerr << "Failed to write " << tmp << endl;
+            throw 0;
+        }
+    }
+    fs::rename(tmp, ledger_path);
+    result.save(outdir);
+}
+
+// Years of an affiliation, bit y for YEAR_BEGIN + y
+typedef uint64_t year_bits_t;
+static_assert(TOTAL_YEARS <= 64);
+
+// Append-only pool interning strings to 32-bit handles, so that a name
+// shared by many institutions and authors is stored once and names compare
+// as integers.  intern may be called from any number of threads: the pool
+// is split into shards by string hash, each with its own lock, and the
+// strings and their entries live in blocks that never move, so get reads
+// without locking.  A handle has the shard in its low SHARD_BITS and the
+// index in the shard above.
+class StringPool {
+public:
+    typedef uint32_t handle_t;
+private:
+    static int constexpr SHARD_BITS = 6;
+    static int constexpr BLOCK_BITS = 12;
+    static size_t constexpr MAX_BLOCKS = size_t(1) << (32 - SHARD_BITS - BLOCK_BITS);
+    // arena chunks double from ARENA_FIRST up to ARENA_CHUNK, so that a
+    // pool holding few strings stays small
+    static size_t constexpr ARENA_FIRST = 1 << 12;
+    static size_t constexpr ARENA_CHUNK = 1 << 20;
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    struct Shard {
+        std::mutex mutex;
+        unordered_map<std::string_view, handle_t> lookup;
+        std::unique_ptr<std::unique_ptr<std::string_view[]>[]> blocks;
+        vector<Chunk> arena;
+        size_t used = 0;        // chunks of the arena in use, the last one being filled
+        char *next = nullptr;
+        size_t left = 0;
+        uint32_t count = 0;
+    };
+    std::unique_ptr<Shard[]> shards;
+
+    std::string_view store (Shard &shard, std::string_view str) {
+        // move on to the next chunk, reusing the ones kept by clear
+        while (str.size() > shard.left) {
+            if (shard.used == shard.arena.size()) {
+                size_t size = shard.arena.empty() ? ARENA_FIRST : std::min(ARENA_CHUNK, 2 * shard.arena.back().size);
+                size = std::max(size, str.size());
+                shard.arena.push_back({std::unique_ptr<char[]>(new char[size]), size});
+            }
+            Chunk &chunk = shard.arena[shard.used++];
+            shard.next = chunk.data.get();
+            shard.left = chunk.size;
+        }
+        memcpy(shard.next, str.data(), str.size());
+        std::string_view stored(shard.next, str.size());
+        shard.next += str.size();
+        shard.left -= str.size();
+        return stored;
+    }
+
+public:
+    StringPool (): shards(new Shard[1 << SHARD_BITS]) {}
+
+    handle_t intern (std::string_view str) {
+        size_t s = mix64(std::hash<std::string_view>()(str)) & ((1 << SHARD_BITS) - 1);
+        Shard &shard = shards[s];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.lookup.find(str);
+        if (it != shard.lookup.end()) return it->second;
+        uint32_t index = shard.count;
+        if ((index >> BLOCK_BITS) >= MAX_BLOCKS) {
+            cerr << "String pool full" << endl;
+            throw 0;
+        }
+        if (!shard.blocks) shard.blocks.reset(new std::unique_ptr<std::string_view[]>[MAX_BLOCKS]);
+        auto &block = shard.blocks[index >> BLOCK_BITS];
+        if (!block) block.reset(new std::string_view[size_t(1) << BLOCK_BITS]);
+        std::string_view stored = store(shard, str);
+        block[index & ((1 << BLOCK_BITS) - 1)] = stored;
+        handle_t handle = (index << SHARD_BITS) | s;
+        shard.lookup.emplace(stored, handle);
+        ++shard.count;
+        return handle;
+    }
+
+    std::string_view get (handle_t handle) const {
+        Shard const &shard = shards[handle & ((1 << SHARD_BITS) - 1)];
+        uint32_t index = handle >> SHARD_BITS;
+        return shard.blocks[index >> BLOCK_BITS][index & ((1 << BLOCK_BITS) - 1)];
+    }
+
+    size_t size () const {
+        size_t n = 0;
+        for (int s = 0; s < (1 << SHARD_BITS); ++s) n += shards[s].count;
+        return n;
+    }
+
+    // Forget all strings; not thread safe.  The shards are reset in place,
+    // keeping their lookup buckets, entry blocks and arena chunks for the
+    // strings interned next.
+    void clear () {
+        for (int s = 0; s < (1 << SHARD_BITS); ++s) {
+            Shard &shard = shards[s];
+            shard.lookup.clear();
+            shard.count = 0;
+            shard.used = 0;
+            shard.next = nullptr;
+            shard.left = 0;
+        }
+    }
+};
+
+typedef StringPool::handle_t name_handle_t;
+
+// Catalogue entries hold handles into the StringPool of their source
+struct InstitutionAuthor {
+    name_handle_t display_name;
+    vector<name_handle_t> alternative_names;
+    year_bits_t years = 0;
+    uint64_t order = 0;     // of the record the names come from
+};
+
+// The position of a record in the scan: file index << 32 | record index.
+// When an author shows up more than once, the names of the last record in
+// this order win, whatever order the threads happen to get to them in.
+inline uint64_t record_order (size_t file, uint32_t record) {
+    return (uint64_t(file) << 32) | record;
+}
+
+struct Institution {
+    int64_t id;
+    name_handle_t display_name;
+    unordered_map<int64_t, InstitutionAuthor> authors;
+};
+
+// One author at one US institution, on its way to the owner of the shard
+struct Membership {
+    int64_t inst_id;
+    name_handle_t inst_name;
+    int64_t author_id;
+    name_handle_t author_name;
+    vector<name_handle_t> alternative_names;
+    year_bits_t years;
+    uint64_t order;
+};
+
+// Institution maps sharded by institution ID hash, one shard per thread.
+// Threads parse any file and route memberships to per-shard outboxes;
+// after every file they post the outboxes to the mailboxes of the shards
+// and apply what was posted to their own shard, so a map is only ever
+// modified by its owner and the locks are only taken per batch.
+class InstitutionShards {
+    struct Shard {
+        unordered_map<int64_t, Institution> institutions;
+        std::mutex mutex;
+        vector<vector<Membership>> mailbox;
+    };
+    vector<std::unique_ptr<Shard>> shards;
+    StringPool names;
+
+    void apply (Shard &shard, Membership &m) {
+        auto [it, inserted] = shard.institutions.try_emplace(m.inst_id);
+        auto &inst = it->second;
+        if (inserted) {
+            inst.id = m.inst_id;
+            inst.display_name = m.inst_name;
+        }
+        else {
+            if (inst.display_name != m.inst_name) {
+                #pragma omp critical
+                cout << "Institution name mismatch: " << names.get(inst.display_name) << " vs " << names.get(m.inst_name) << endl;
+            }
+        }
+        auto [at, fresh] = inst.authors.try_emplace(m.author_id);
+        auto &author = at->second;
+        if (fresh || m.order > author.order) {
+            author.display_name = m.author_name;
+            author.alternative_names = std::move(m.alternative_names);
+            author.order = m.order;
+        }
+        author.years |= m.years;
+    }
+
+public:
+    InstitutionShards (int n) {
+        for (int i = 0; i < n; ++i) shards.emplace_back(new Shard);
+    }
+
+    size_t size () const { return shards.size(); }
+
+    // names are interned by the parsing threads
+    name_handle_t intern (std::string_view str) { return names.intern(str); }
+    StringPool const &pool () const { return names; }
+
+    size_t owner (int64_t inst_id) const {
+        return mix64(inst_id) % shards.size();
+    }
+
+    // hand the outbox batches (one per shard) over to their owners
+    void post (vector<vector<Membership>> *outbox) {
+        for (size_t s = 0; s < shards.size(); ++s) {
+            auto &batch = (*outbox)[s];
+            if (batch.empty()) continue;
+            std::lock_guard<std::mutex> lock(shards[s]->mutex);
+            shards[s]->mailbox.push_back(std::move(batch));
+            batch.clear();
+        }
+    }
+
+    // apply the posted batches of shard s; only called by its owner
+    void drain (size_t s) {
+        Shard &shard = *shards[s];
+        vector<vector<Membership>> batches;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            batches.swap(shard.mailbox);
+        }
+        for (auto &batch: batches) {
+            for (auto &m: batch) apply(shard, m);
+        }
+    }
+
+    template <typename F>
+    void for_each (F const &f) const {
+        for (auto const &shard: shards) {
+            for (auto const &[id, inst]: shard->institutions) f(inst);
+        }
+    }
+};
+
+// Stream institutions.json (institutions.json.gz with --gzip) one
+// institution and one author at a time straight from the source
+// (InstitutionShards or InstitutionSpill), so that no DOM of the whole
+// catalogue is built.  Indented like json::dump(2)
+// unless --compact, which writes one author per line.  The same pass
+// builds institutions.idx, the binary index match_emails maps, whose
+// sections are spilled to temporary files under --memory_budget.
+template <typename Source>
+void write_institutions (string const &outdir, Source &source) {
+    bool pretty = !options::compact;
+    string path = outdir + "/institutions.json" + (options::gzip ? ".gz" : "");
+    std::unique_ptr<BlockWriter> gz;
+    vector<char> os_buffer(1 << 20);
+    ofstream os;
+    if (options::gzip) {
+        gz.reset(new BlockWriter(path));
+    }
+    else {
+        os.rdbuf()->pubsetbuf(&os_buffer[0], os_buffer.size());
+        os.open(path);
+    }
+    auto emit = [&](string const &text) {
+        if (gz) gz->write(text);
+        else os << text << '\n';
+    };
+    auto indent = [pretty](int depth) {
+        return pretty ? string(2 * depth, ' ') : string();
+    };
+    // an element of an array at the given depth
+    auto element = [&](json const &j, int depth) {
+        if (!pretty) return j.dump();
+        string ind = indent(depth);
+        string text = ind;
+        for (char c: j.dump(2)) {
+            text.push_back(c);
+            if (c == '\n') text += ind;
+        }
+        return text;
+    };
+    // the last element of an array goes without a comma, so every element
+    // is held back until the next one (or the end of the array) is seen
+    string held;
+    std::unique_ptr<InstitutionIndexBuilder> builder;
+    if (options::memory_budget > 0) {
+        builder.reset(new InstitutionIndexBuilder(YEAR_BEGIN, format("{}/.institutions.idx.{}", outdir, getpid()),
+                                                  (options::memory_budget << 20) / 2));
+    }
+    else {
+        builder.reset(new InstitutionIndexBuilder(YEAR_BEGIN));
+    }
+    InstitutionIndexBuilder &index = *builder;
+    emit("[");
+    source.for_each([&](Institution const &inst) {
+        StringPool const &names = source.pool();
+        index.add_institution(inst.id, names.get(inst.display_name));
+        if (!held.empty()) emit(held + ",");
+        emit(indent(1) + "{");
+        emit(indent(2) + (pretty ? "\"authors\": [" : "\"authors\":["));
+        string author_held;
+        for (auto const &[author_id, entry]: inst.authors) {
+            if (!author_held.empty()) emit(author_held + ",");
+            json author;
+            author["id"] = std::to_string(author_id);
+            vector<std::string_view> alternatives;
+            for (auto h: entry.alternative_names) alternatives.push_back(names.get(h));
+            author["display_name"] = names.get(entry.display_name);
+            author["display_name_alternatives"] = alternatives;
+            vector<int> years;
+            for (year_bits_t bits = entry.years; bits; bits &= bits - 1) {
+                years.push_back(YEAR_BEGIN + __builtin_ctzll(bits));
+            }
+            author["years"] = years;
+            author_held = element(author, 3);
+            index.add_author(author_id, names.get(entry.display_name), alternatives, entry.years);
+        }
+        if (!author_held.empty()) emit(author_held);
+        string name = json(names.get(inst.display_name)).dump();
+        string id = json(std::to_string(inst.id)).dump();
+        if (pretty) {
+            emit(indent(2) + "],");
+            emit(indent(2) + "\"display_name\": " + name + ",");
+            emit(indent(2) + "\"id\": " + id);
+            held = indent(1) + "}";
+        }
+        else {
+            held = "],\"display_name\":" + name + ",\"id\":" + id + "}";
+        }
+    });
+    if (!held.empty()) emit(held);
+    emit("]");
+    if (gz) gz->close();
+    index.save(outdir + "/institutions.idx");
+}
+
+// The names and US institutions of one author record
+struct AuthorAffiliations {
+    struct Affiliation {
+        int64_t inst_id;
+        string display_name;
+        year_bits_t years;
+    };
+    int64_t author_id;
+    string author_name;
+    vector<string> alternative_names;
+    vector<Affiliation> institutions;
+
+    AuthorAffiliations (json const &j) {
+        author_id = extract_id(j["id"], "https://openalex.org/A");
+        author_name = j["display_name"];
+        if (j.contains("display_name_alternatives")) {
+            for (auto const &jname : j["display_name_alternatives"]) {
+                string name = jname.get<string>();
+                string regular;
+                regular.reserve(name.size());
+                while (!name.empty() && std::isspace(name.front())) name.erase(0, 1);
+                while (!name.empty() && std::isspace(name.back())) name.pop_back();
+                for (char c: name) {
+                    if (c == '"') continue;
+                    regular.push_back(c);
+                }
+                alternative_names.push_back(regular);
+            }
+        }
+        if (j.contains("affiliations")) {
+            for (auto const &affiliation : j["affiliations"]) {
+                string country = affiliation["institution"]["country_code"];
+                if (country != "US") continue;
+                int64_t inst_id = extract_id(affiliation["institution"]["id"], "https://openalex.org/I");
+                string display_name = affiliation["institution"]["display_name"];
+                {
+                    // There's one single "Hematology\Oncology Clinic"
+                    // which is very annoying.
+                    auto off = display_name.find('\\');
+                    if (off != string::npos) {
+                        display_name[off] = ' ';
+                    }
+                }
+                year_bits_t years = 0;
+                for (int year: affiliation["years"]) {
+                    if (year >= YEAR_BEGIN && year < YEAR_END) years |= year_bits_t(1) << (year - YEAR_BEGIN);
+                }
+                institutions.push_back({inst_id, display_name, years});
+            }
+        }
+    }
+};
+
+// Institution aggregation within a memory budget (--memory_budget).
+// Every thread appends the names of an author once to its own name file
+// and emits an (institution, author, name reference) entry per US
+// affiliation into a RecordSpool, whose buffers are sized by the budget
+// and spilled as sorted runs.  for_each k-way merges the runs and yields
+// the institutions one at a time, so only the largest institution and the
+// institution names are ever held in memory.  The names of the yielded
+// institution are interned into a pool cleared between institutions.
+class InstitutionSpill {
+    struct Entry {
+        int64_t inst_id;
+        int64_t author_id;
+        uint64_t name;      // thread << 48 | offset in the name file of the thread
+        year_bits_t years;
+        uint64_t order;     // record_order, so that the last record's names win
+        bool operator < (Entry const &other) const {
+            return std::tie(inst_id, author_id, order) < std::tie(other.inst_id, other.author_id, other.order);
+        }
+    };
+    static int constexpr NAME_SHIFT = 48;
+    string dir;
+    RecordSpool<Entry> spool;
+    struct Thread {
+        ofstream names;
+        uint64_t written = 0;
+        unordered_map<int64_t, string> institutions;
+    };
+    vector<std::unique_ptr<Thread>> threads;
+    StringPool names;
+
+    static size_t block (size_t budget) {
+        return std::max<size_t>(1 << 10, budget / omp_get_max_threads() / sizeof(Entry));
+    }
+
+    string names_path (int thread) const {
+        return format("{}/names.{}", dir, thread);
+    }
+
+    static void put (string *buf, string const &str) {
+        uint32_t len = str.size();
+        buf->append(reinterpret_cast<char const *>(&len), sizeof(len));
+        buf->append(str);
+    }
+
+    static string get (char const **p) {
+        uint32_t len;
+        memcpy(&len, *p, sizeof(len));
+        string str(*p + sizeof(len), len);
+        *p += sizeof(len) + len;
+        return str;
+    }
+
+public:
+    InstitutionSpill (string const &dir_, size_t budget)
+        : dir(dir_), spool(dir_ + "/runs", block(budget)) {
+        for (int i = 0; i < omp_get_max_threads(); ++i) {
+            threads.emplace_back(new Thread);
+            threads.back()->names.open(names_path(i), std::ios::binary);
+        }
+    }
+
+    ~InstitutionSpill () {
+        threads.clear();
+        fs::remove_all(dir);
+    }
+
+    void add (AuthorAffiliations const &a, uint64_t order) {
+        if (a.institutions.empty()) return;
+        int thread = omp_get_thread_num();
+        Thread &t = *threads[thread];
+        string buf;
+        put(&buf, a.author_name);
+        uint32_t n = a.alternative_names.size();
+        buf.append(reinterpret_cast<char const *>(&n), sizeof(n));
+        for (auto const &alt: a.alternative_names) put(&buf, alt);
+        uint64_t name = (uint64_t(thread) << NAME_SHIFT) | t.written;
+        t.names.write(buf.data(), buf.size());
+        t.written += buf.size();
+        for (auto const &[inst_id, display_name, years]: a.institutions) {
+            auto it = t.institutions.find(inst_id);
+            if (it == t.institutions.end()) {
+                t.institutions.emplace(inst_id, display_name);
+            }
+            else if (it->second != display_name) {
+                #pragma omp critical
+                cout << "Institution name mismatch: " << it->second << " vs " << display_name << endl;
+            }
+            spool.push({inst_id, a.author_id, name, years, order});
+        }
+    }
+
+    StringPool const &pool () const { return names; }
+
+    // Call f(Institution const &) for every institution in ID order.
+    // Must be called outside of the parallel region.
+    template <typename F>
+    void for_each (F const &f) {
+        unordered_map<int64_t, string> institutions;
+        vector<std::pair<char const *, size_t>> maps;
+        for (int i = 0; i < int(threads.size()); ++i) {
+            for (auto &[id, name]: threads[i]->institutions) {
+                auto it = institutions.find(id);
+                if (it == institutions.end()) institutions.emplace(id, std::move(name));
+                else if (it->second != name) {
+                    cout << "Institution name mismatch: " << it->second << " vs " << name << endl;
+                }
+            }
+            threads[i]->institutions.clear();
+            threads[i]->names.close();
+            size_t length = threads[i]->written;
+            char const *base = nullptr;
+            if (length > 0) {
+                int fd = open(names_path(i).c_str(), O_RDONLY);
+                if (fd < 0) {
+                    cerr << "Cannot open " << names_path(i) << endl;
+                    throw 0;
+                }
+                void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+                close(fd);
+                if (p == MAP_FAILED) {
+                    cerr << "Cannot map " << names_path(i) << endl;
+                    throw 0;
+                }
+                base = static_cast<char const *>(p);
+            }
+            maps.emplace_back(base, length);
+        }
+        Institution inst;
+        inst.id = INVALID_ID;
+        spool.merge([&](Entry const &e) {
+            if (e.inst_id != inst.id) {
+                if (inst.id != INVALID_ID) f(inst);
+                names.clear();
+                inst.id = e.inst_id;
+                inst.display_name = names.intern(institutions[e.inst_id]);
+                inst.authors.clear();
+            }
+            char const *p = maps[e.name >> NAME_SHIFT].first + (e.name & ((uint64_t(1) << NAME_SHIFT) - 1));
+            name_handle_t name = names.intern(get(&p));
+            uint32_t n;
+            memcpy(&n, p, sizeof(n));
+            p += sizeof(n);
+            vector<name_handle_t> alternatives;
+            for (uint32_t k = 0; k < n; ++k) alternatives.push_back(names.intern(get(&p)));
+            auto &author = inst.authors[e.author_id];
+            author.display_name = name;
+            author.alternative_names = std::move(alternatives);
+            author.order = e.order;
+            author.years |= e.years;
+        });
+        if (inst.id != INVALID_ID) f(inst);
+        for (auto const &[base, length]: maps) {
+            if (base) munmap(const_cast<char *>(base), length);
+        }
+    }
+};
+
+// The US institution catalogue (institutions.json and institutions.idx)
+// of the scanned authors.  By default the institution maps are sharded
+// by ID, one shard per thread: a file routes its memberships to
+// per-shard outboxes, posts them to the owners when finished, and the
+// finishing thread then applies what was posted to its own shard.  With
+// --memory_budget the memberships go to an InstitutionSpill instead.
+class InstitutionConsumer: public ScanConsumer {
+    string outdir;
+    std::unique_ptr<InstitutionSpill> spill;
+    std::unique_ptr<InstitutionShards> shards;
+
+    // index of every input file, for record_order
+    unordered_map<string, size_t> file_index;
+
+    class SpillFile: public ScanConsumer::File {
+        InstitutionSpill &spill;
+        size_t file;
+        uint32_t records = 0;
+    public:
+        SpillFile (InstitutionSpill &spill_, size_t file_): spill(spill_), file(file_) {}
+        void add (AuthorRecord &record) {
+            spill.add(AuthorAffiliations(record.j), record_order(file, records++));
+        }
+        void finish () {}
+    };
+
+    class ShardFile: public ScanConsumer::File {
+        InstitutionShards &shards;
+        vector<vector<Membership>> outbox;
+        size_t file;
+        uint32_t records = 0;
+    public:
+        ShardFile (InstitutionShards &shards_, size_t file_): shards(shards_), outbox(shards_.size()), file(file_) {}
+        void add (AuthorRecord &record) {
+            AuthorAffiliations a(record.j);
+            uint64_t order = record_order(file, records++);
+            if (a.institutions.empty()) return;
+            name_handle_t author_name = shards.intern(a.author_name);
+            vector<name_handle_t> alternatives;
+            for (auto const &alt: a.alternative_names) alternatives.push_back(shards.intern(alt));
+            for (auto const &[inst_id, display_name, years]: a.institutions) {
+                outbox[shards.owner(inst_id)].push_back({inst_id, shards.intern(display_name), a.author_id,
+                                                         author_name, alternatives, years, order});
+            }
+        }
+        void finish () {
+            shards.post(&outbox);
+            size_t own = omp_get_thread_num();
+            if (own < shards.size()) shards.drain(own);
+        }
+    };
+
+public:
+    InstitutionConsumer (string const &outdir_): outdir(outdir_) {}
+
+    void start (vector<string> const &files) {
+        for (size_t i = 0; i < files.size(); ++i) file_index[files[i]] = i;
+        fs::create_directories(outdir);
+        if (options::memory_budget > 0) {
+            spill.reset(new InstitutionSpill(format("{}/.institution_spool.{}", outdir, getpid()), options::memory_budget << 20));
+        }
+        else {
+            shards.reset(new InstitutionShards(omp_get_max_threads()));
+        }
+    }
+
+    std::unique_ptr<ScanConsumer::File> open (string const &path) {
+        size_t file = file_index.at(path);
+        if (spill) return std::unique_ptr<ScanConsumer::File>(new SpillFile(*spill, file));
+        return std::unique_ptr<ScanConsumer::File>(new ShardFile(*shards, file));
+    }
+
+    void finish () {
+        if (spill) {
+            write_institutions(outdir, *spill);
+            spill.reset();
+            return;
+        }
+        // the last batches, and those of shards whose owner thread never ran
+        for (size_t s = 0; s < shards->size(); ++s) shards->drain(s);
+        write_institutions(outdir, *shards);
+        shards.reset();
+    }
+};
+
+void list_institutions (string const &datadir, string const &outdir) {
+    InstitutionConsumer institutions(outdir);
+    scan_authors(datadir, {&institutions});
 }
 
-struct Outflow {
-    int64_t author_id;
-    int year;
-    int is_chinese;
-    int is_experienced;
+// A (origin institution, destination institution, year) cell of the
+// institution level migration flows
+struct FlowKey {
+    int64_t origin;
+    int64_t destination;
+    int64_t year_offset;
+    bool operator == (FlowKey const &other) const {
+        return origin == other.origin && destination == other.destination && year_offset == other.year_offset;
+    }
+    uint64_t hash () const {
+        return mix64(origin ^ mix64(destination ^ mix64(year_offset + 0x9e3779b97f4a7c15ULL)));
+    }
 };
 
-void count_migration_outflow (string const &datadir, string const &outdir,
-                              std::unordered_set<int64_t> const &filter) {
+struct FlowKeyHash {
+    size_t operator () (FlowKey const &key) const { return key.hash(); }
+};
+
+// SpaceSaving heavy hitters (Metwally et al.) over at most capacity
+// counters.  A key counted n times in a stream of N is always kept if
+// n > N / capacity; count over-estimates by at most error.  Two summaries
+// merge by adding counts, a key missing on one side being charged that
+// side's minimum, then keeping the largest capacity counters.
+class SpaceSaving {
+public:
+    struct Counter {
+        FlowKey key;
+        int64_t count;
+        int64_t error;
+    };
+private:
+    size_t capacity;
+    vector<Counter> counters;
+    unordered_map<FlowKey, size_t, FlowKeyHash> where;
+    std::set<std::pair<int64_t, size_t>> order;     // (count, counter), the minimum first
+
+    void bump (size_t c, int64_t n) {
+        order.erase({counters[c].count, c});
+        counters[c].count += n;
+        order.insert({counters[c].count, c});
+    }
+
+public:
+    SpaceSaving (size_t capacity_ = 0): capacity(capacity_) {}
+
+    // the smallest count, 0 while not full
+    int64_t floor () const {
+        return counters.size() < capacity || order.empty() ? 0 : order.begin()->first;
+    }
+
+    void add (FlowKey const &key, int64_t n = 1) {
+        auto it = where.find(key);
+        if (it != where.end()) {
+            bump(it->second, n);
+            return;
+        }
+        if (counters.size() < capacity) {
+            where.emplace(key, counters.size());
+            counters.push_back({key, 0, 0});
+            order.insert({0, counters.size() - 1});
+            bump(counters.size() - 1, n);
+            return;
+        }
+        // evict the minimum; the newcomer inherits its count as error
+        size_t c = order.begin()->second;
+        where.erase(counters[c].key);
+        where.emplace(key, c);
+        counters[c].key = key;
+        counters[c].error = counters[c].count;
+        bump(c, n);
+    }
+
+    void merge (SpaceSaving const &other) {
+        int64_t floor_this = floor();
+        int64_t floor_other = other.floor();
+        unordered_map<FlowKey, Counter, FlowKeyHash> sum;
+        for (auto const &c: counters) {
+            sum[c.key] = {c.key, c.count + floor_other, c.error + floor_other};
+        }
+        for (auto const &c: other.counters) {
+            auto it = sum.find(c.key);
+            if (it == sum.end()) {
+                sum[c.key] = {c.key, c.count + floor_this, c.error + floor_this};
+            }
+            else {
+                // the key was seen on both sides, so nothing was charged
+                it->second.count += c.count - floor_other;
+                it->second.error += c.error - floor_other;
+            }
+        }
+        vector<Counter> all;
+        for (auto &[key, c]: sum) all.push_back(c);
+        size_t keep = std::min(capacity, all.size());
+        std::partial_sort(all.begin(), all.begin() + keep, all.end(),
+                          [](Counter const &a, Counter const &b) { return a.count > b.count; });
+        all.resize(keep);
+        counters.clear();
+        where.clear();
+        order.clear();
+        for (auto const &c: all) {
+            where.emplace(c.key, counters.size());
+            order.insert({c.count, counters.size()});
+            counters.push_back(c);
+        }
+    }
+
+    vector<Counter> const &entries () const { return counters; }
+};
+
+// Count-Min sketch of the flow cells; estimates never undercount.
+class CountMin {
+    static int constexpr DEPTH = 4;
+    static int constexpr WIDTH_BITS = 16;
+    vector<int64_t> table;
+
+    static size_t cell (uint64_t hash, int row) {
+        return (size_t(row) << WIDTH_BITS) + (mix64(hash + row * 0x9e3779b97f4a7c15ULL) & ((size_t(1) << WIDTH_BITS) - 1));
+    }
+
+public:
+    CountMin (): table(size_t(DEPTH) << WIDTH_BITS, 0) {}
+
+    void add (FlowKey const &key, int64_t n = 1) {
+        uint64_t h = key.hash();
+        for (int row = 0; row < DEPTH; ++row) table[cell(h, row)] += n;
+    }
+
+    int64_t estimate (FlowKey const &key) const {
+        uint64_t h = key.hash();
+        int64_t est = table[cell(h, 0)];
+        for (int row = 1; row < DEPTH; ++row) est = std::min(est, table[cell(h, row)]);
+        return est;
+    }
+
+    void merge (CountMin const &other) {
+        for (size_t i = 0; i < table.size(); ++i) table[i] += other.table[i];
+    }
+};
+
+// The institution pairs an author record contributes to a flow
+// direction: the institutions of the origin country in the last year
+// there before the migration year, times those of the destination country
+// in the first year there from the migration year on.  For the outflow
+// the origin is the US, for the inflow the destination is.
+struct AuthorFlows {
+    struct Affiliation {
+        int64_t inst_id;
+        string display_name;
+        uint32_t country_id;
+        year_bits_t years;
+    };
+    vector<Affiliation> affiliations;
+    vector<FlowKey> keys;
+
+    AuthorFlows (json const &j, SurveyType type) {
+        Author author(j);
+        Migration mig = author.years.get_migration(type);
+        if (mig.country_id == 0) return;
+        uint32_t origin_country = type == SURVEY_INFLOW ? mig.country_id : COUNTRY_ID_US;
+        uint32_t destination_country = type == SURVEY_INFLOW ? COUNTRY_ID_US : mig.country_id;
+        int origin_year = mig.year_offset - 1;
+        while (origin_year >= 0 && (author.years.mask(origin_year) & (1 << origin_country)) == 0) --origin_year;
+        int destination_year = mig.year_offset;
+        while (destination_year < TOTAL_YEARS && (author.years.mask(destination_year) & (1 << destination_country)) == 0) ++destination_year;
+        if (origin_year < 0 || destination_year >= TOTAL_YEARS) return;
+        for (auto const &affiliation : j["affiliations"]) {
+            Affiliation a;
+            a.inst_id = extract_id(affiliation["institution"]["id"], "https://openalex.org/I");
+            a.display_name = affiliation["institution"]["display_name"];
+            a.country_id = CountryLookup::get(affiliation["institution"]["country_code"].get<string>());
+            a.years = 0;
+            for (int year: affiliation["years"]) {
+                if (year >= YEAR_BEGIN && year < YEAR_END) a.years |= year_bits_t(1) << (year - YEAR_BEGIN);
+            }
+            affiliations.push_back(a);
+        }
+        for (auto const &o: affiliations) {
+            if (o.country_id != origin_country || !(o.years >> origin_year & 1)) continue;
+            for (auto const &d: affiliations) {
+                if (d.country_id != destination_country || !(d.years >> destination_year & 1)) continue;
+                if (o.inst_id == d.inst_id) continue;
+                FlowKey key{o.inst_id, d.inst_id, mig.year_offset};
+                if (std::find(keys.begin(), keys.end(), key) == keys.end()) keys.push_back(key);
+            }
+        }
+    }
+};
+
+// Heavy hitter sketches of one flow direction: a SpaceSaving summary per
+// migration year and one Count-Min over all cells.
+struct FlowSketch {
+    vector<SpaceSaving> years;
+    CountMin cm;
+
+    FlowSketch (size_t capacity): years(TOTAL_YEARS, SpaceSaving(capacity)) {}
+
+    void add (FlowKey const &key) {
+        years[key.year_offset].add(key);
+        cm.add(key);
+    }
+
+    void merge (FlowSketch const &other) {
+        for (int y = 0; y < TOTAL_YEARS; ++y) years[y].merge(other.years[y]);
+        cm.merge(other.cm);
+    }
+};
+
+// Top-K origin / destination institution pairs per migration year.  The
+// first pass feeds every (origin, destination, year) cell into per-file
+// sketches merged into one; an exact table of all institution pairs would
+// not fit.  The candidates (the 4K best of each year by the tighter of the
+// two estimates) are then counted exactly in a second pass and the K
+// largest exact counts are reported.  An author at several institutions
+// counts once for each pair.
+void count_institution_flows (string const &datadir, SurveyType type, size_t top_k, string const &path) {
     vector<string> files;
     scan_files(datadir, &files);
-    cout << "Found " << files.size() << " files" << endl;
-    int done = 0;
-    Survey survey(SURVEY_OUTFLOW);
-    Survey survey_experienced(SURVEY_OUTFLOW_EXPERIENCED);
-    Survey survey_not_experienced(SURVEY_OUTFLOW_NOT_EXPERIENCED);
-    vector<Outflow> outflows;
-    #pragma omp parallel for
+    cout << "Found " << files.size() << " files in " << datadir << endl;
+    size_t capacity = 8 * top_k;
+    FlowSketch sketch(capacity);
+    #pragma omp parallel for schedule(dynamic)
     for (size_t i = 0; i < files.size(); ++i) {
-        bxz::ifstream iss(files[i]);
+        AuthorReader reader(files[i]);
         string line;
-        Survey local(SURVEY_OUTFLOW);
-        Survey local_experienced(SURVEY_OUTFLOW_EXPERIENCED);
-        Survey local_not_experienced(SURVEY_OUTFLOW_NOT_EXPERIENCED);
-        while (getline(iss, line)) {
+        FlowSketch local(capacity);
+        while (reader.next(&line)) {
             try {
-                Author author(json::parse(line));
-                if (!filter.empty()) {
-                    if (filter.count(author.id) == 0) continue;
-                }
-                Migration mig = author.years.get_migration(SURVEY_OUTFLOW);
-                if (mig.year_offset >= 0) {
-                    #pragma omp critical
-                    {
-                        int is_chinese = Surnames::is_chinese(author.display_name) ? 1 : 0;
-                        int is_experienced = author.works_count >= EXPERIENCED_THRESHOLD ? 1 : 0;
-                        outflows.push_back({author.id, mig.year_offset + YEAR_BEGIN, is_chinese, is_experienced});
+                AuthorFlows flows(json::parse(line), type);
+                for (auto const &key: flows.keys) local.add(key);
+            } catch (const json::exception& e) {
+                errors::bad_json += 1;
+            }
+        }
+        #pragma omp critical
+        sketch.merge(local);
+    }
+    std::unordered_set<FlowKey, FlowKeyHash> candidates;
+    unordered_map<FlowKey, int64_t, FlowKeyHash> estimates;
+    for (auto const &summary: sketch.years) {
+        vector<std::pair<int64_t, FlowKey>> ranked;
+        for (auto const &c: summary.entries()) {
+            ranked.push_back({std::min(c.count, sketch.cm.estimate(c.key)), c.key});
+        }
+        size_t keep = std::min(4 * top_k, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                          [](auto const &a, auto const &b) { return a.first > b.first; });
+        for (size_t k = 0; k < keep; ++k) {
+            candidates.insert(ranked[k].second);
+            estimates[ranked[k].second] = ranked[k].first;
+        }
+    }
+    cout << format("Counting {} candidate pairs exactly", candidates.size()) << endl;
+    unordered_map<FlowKey, int64_t, FlowKeyHash> exact;
+    unordered_map<int64_t, std::pair<string, uint32_t>> institutions;     // name, country
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < files.size(); ++i) {
+        AuthorReader reader(files[i]);
+        string line;
+        unordered_map<FlowKey, int64_t, FlowKeyHash> local;
+        unordered_map<int64_t, std::pair<string, uint32_t>> names;
+        while (reader.next(&line)) {
+            try {
+                AuthorFlows flows(json::parse(line), type);
+                bool hit = false;
+                for (auto const &key: flows.keys) {
+                    if (candidates.count(key)) {
+                        local[key] += 1;
+                        hit = true;
                     }
                 }
-                local.add(author);
-                local_experienced.add(author);
-                local_not_experienced.add(author);
+                if (!hit) continue;
+                for (auto const &a: flows.affiliations) names[a.inst_id] = {a.display_name, a.country_id};
             } catch (const json::exception& e) {
                 errors::bad_json += 1;
             }
         }
         #pragma omp critical
         {
-            survey.merge(local);
-            survey_experienced.merge(local_experienced);
-            survey_not_experienced.merge(local_not_experienced);
-            ++done;
-            cout << format("Processed {}/{}", done, files.size()) << endl;
+            for (auto const &[key, n]: local) exact[key] += n;
+            institutions.merge(names);
         }
     }
-    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
-    survey.save(outdir + "/outflow");
-    survey_experienced.save(outdir + "/outflow_experienced");
-    survey_not_experienced.save(outdir + "/outflow_not_experienced");
-    ofstream os(outdir + "/outflow.txt");
-    os << "author_id,year,is_chinese,is_experienced" << endl;
-    for (auto const &o: outflows) {
-        os << o.author_id << "," << o.year << "," << o.is_chinese << "," << o.is_experienced <<  endl;
+    vector<std::pair<int64_t, FlowKey>> top;
+    for (auto const &[key, n]: exact) top.push_back({n, key});
+    std::sort(top.begin(), top.end(), [](auto const &a, auto const &b) {
+        return std::make_tuple(a.second.year_offset, -a.first, a.second.origin, a.second.destination)
+             < std::make_tuple(b.second.year_offset, -b.first, b.second.origin, b.second.destination);
+    });
+    auto quote = [](string const &s) {
+        string out = "\"";
+        for (char c: s) {
+            if (c == '"') out.push_back('"');
+            out.push_back(c);
+        }
+        return out + "\"";
+    };
+    // like dump_counts, scaled to estimates of the full population when sampling
+    auto scaled = [](int64_t n) {
+        if (!Sampler::enabled()) return std::to_string(n);
+        return format("{:.1f}", n / options::sample);
+    };
+    ofstream os(path);
+    os << "year,origin_id,origin_name,origin_country,destination_id,destination_name,destination_country,count,estimate" << endl;
+    int64_t year = -1;
+    size_t rank = 0;
+    for (auto const &[n, key]: top) {
+        if (key.year_offset != year) {
+            year = key.year_offset;
+            rank = 0;
+        }
+        if (rank++ >= top_k) continue;
+        auto const &o = institutions[key.origin];
+        auto const &d = institutions[key.destination];
+        os << YEAR_BEGIN + key.year_offset << ',' << key.origin << ',' << quote(o.first) << ',' << COUNTRY_CODES[o.second]
+           << ',' << key.destination << ',' << quote(d.first) << ',' << COUNTRY_CODES[d.second]
+           << ',' << scaled(n) << ',' << scaled(estimates[key]) << endl;
     }
 }
 
-struct Institution {
-    int64_t id;
-    string display_name;
-    unordered_map<int64_t, std::pair<string, vector<string>>> authors;
+void count_institution_flows (string const &outdir, size_t top_k) {
+    string dir = outdir + "/institution_flows";
+    fs::create_directories(dir);
+    count_institution_flows("data/filtered_outflow", SURVEY_OUTFLOW, top_k, dir + "/outflow.csv");
+    count_institution_flows("data/filtered_inflow", SURVEY_INFLOW, top_k, dir + "/inflow.csv");
+    json meta;
+    meta["year_begin"] = YEAR_BEGIN;
+    meta["year_end"] = YEAR_END;
+    meta["top_k"] = top_k;
+    meta["sketch_capacity"] = 8 * top_k;
+    Sampler::describe(&meta);
+    ofstream os(dir + "/meta.json");
+    os << meta.dump(2) << endl;
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+}
+
+// Migration timing from publications.  The affiliation years of an author
+// record are a coarse summary; the works snapshot has the country of every
+// authorship in every publication year.  work_years streams the works once
+// and joins them with the authors of the filtered files: a work is only
+// parsed if its raw line mentions one of those authors (AuthorIdSet), and
+// each matching (author, year, country) goes to a RecordSpool, so the join
+// is an external sort however large the snapshot.  Merging the spool
+// rebuilds the year masks from publications and dates the migrations with
+// the same rules as the affiliation years.
+struct WorkYear {
+    int64_t author_id;
+    int32_t year;
+    uint32_t country_id;
+    bool operator < (WorkYear const &other) const {
+        return std::tie(author_id, year, country_id) < std::tie(other.author_id, other.year, other.country_id);
+    }
 };
 
-void list_institutions (string const &datadir, string const &outdir) {
+// Migrations of a filtered author by its affiliation years
+struct AffiliationTiming {
+    int64_t author_id;
+    Migration outflow;
+    Migration inflow;
+};
+
+// Whether the raw work line mentions an author of the set
+bool mentions_author (string const &line, AuthorIdSet const &ids) {
+    static string const PREFIX = Author::URL_PREFIX;
+    for (size_t off = line.find(PREFIX); off != string::npos; off = line.find(PREFIX, off)) {
+        off += PREFIX.size();
+        int64_t id = 0;
+        size_t begin = off;
+        while (off < line.size() && std::isdigit(line[off])) {
+            id = id * 10 + (line[off] - '0');
+            ++off;
+        }
+        if (off > begin && ids.contains(id)) return true;
+    }
+    return false;
+}
+
+// Spool block of each thread by default: an eighth of the physical memory
+// between all threads, as the spool is the only large buffer of the join.
+size_t work_year_block () {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0) return 1 << 20;
+    size_t memory = size_t(pages) * size_t(page_size);
+    return std::max<size_t>(1 << 16, memory / 8 / omp_get_max_threads() / sizeof(WorkYear));
+}
+
+void count_work_years (string const &worksdir, string const &outdir) {
+    if (options::shard_count > 1) {
+        // every author needs the works of all files, and there is no merge
+        cerr << "work_years does not support --shard" << endl;
+        throw 0;
+    }
+    // the authors to join, with their migrations by affiliation
+    vector<AffiliationTiming> timings;
+    for (char const *dir: {"data/filtered_outflow", "data/filtered_inflow"}) {
+        vector<string> files = list_files(dir);
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < files.size(); ++i) {
+            AuthorReader reader(files[i]);
+            string line;
+            vector<AffiliationTiming> local;
+            while (reader.next(&line)) {
+                try {
+                    Author author(json::parse(line));
+                    local.push_back({author.id, author.years.get_migration_outflow(), author.years.get_migration_inflow()});
+                } catch (const json::exception& e) {
+                    errors::bad_json += 1;
+                }
+            }
+            #pragma omp critical
+            timings.insert(timings.end(), local.begin(), local.end());
+        }
+    }
+    std::sort(timings.begin(), timings.end(), [](auto const &a, auto const &b) { return a.author_id < b.author_id; });
+    // an author may be in both directories
+    timings.erase(std::unique(timings.begin(), timings.end(), [](auto const &a, auto const &b) {
+        return a.author_id == b.author_id;
+    }), timings.end());
+    vector<int64_t> ids;
+    for (auto const &t: timings) ids.push_back(t.author_id);
+    AuthorIdSet authors(ids);
+    cout << format("Joining {} filtered authors", authors.size()) << endl;
+
     vector<string> files;
-    scan_files(datadir, &files);
+    scan_files(worksdir, &files);
     cout << "Found " << files.size() << " files" << endl;
-    unordered_map<int64_t, Institution> institutions;
+    fs::create_directories(outdir);
+    size_t block = options::memory_budget > 0
+        ? std::max<size_t>(1 << 10, (options::memory_budget << 20) / omp_get_max_threads() / sizeof(WorkYear))
+        : work_year_block();
+    RecordSpool<WorkYear> spool(format("{}/.work_spool.{}", outdir, getpid()), block);
+    std::atomic<uint64_t> parsed = 0;
+    int done = 0;
+    #pragma omp parallel for schedule(dynamic)
     for (size_t i = 0; i < files.size(); ++i) {
-        bxz::ifstream iss(files[i]);
+        bxz::ifstream is(files[i]);
         string line;
-        while (getline(iss, line)) {
+        while (getline(is, line)) {
+            if (!mentions_author(line, authors)) continue;
             try {
-                auto j = json::parse(line);
-                int64_t author_id = extract_id(j["id"], "https://openalex.org/A");
-                string author_name = j["display_name"];
-                vector<string> alternative_names;
-                if (j.contains("display_name_alternatives")) {
-                    for (auto const &jname : j["display_name_alternatives"]) {
-                        string name = jname.get<string>();
-                        string regular;
-                        regular.reserve(name.size());
-                        while (!name.empty() && std::isspace(name.front())) name.erase(0, 1);
-                        while (!name.empty() && std::isspace(name.back())) name.pop_back();
-                        for (char c: name) {
-                            if (c == '"') continue;
-                            regular.push_back(c);
+                json j = json::parse(line);
+                ++parsed;
+                if (!j.contains("publication_year") || !j["publication_year"].is_number_integer()) continue;
+                int year = j["publication_year"];
+                if (year < YEAR_BEGIN || year >= YEAR_END) continue;
+                for (auto const &authorship: j["authorships"]) {
+                    if (!authorship["author"]["id"].is_string()) continue;
+                    int64_t author_id = extract_id(authorship["author"]["id"], Author::URL_PREFIX);
+                    if (!authors.contains(author_id)) continue;
+                    // "countries" if present, else those of the institutions
+                    vector<string> countries;
+                    if (authorship.contains("countries")) {
+                        for (auto const &c: authorship["countries"]) {
+                            if (c.is_string()) countries.push_back(c);
                         }
-                        alternative_names.push_back(regular);
                     }
-                }
-                if (j.contains("affiliations")) {
-                    for (auto const &affiliation : j["affiliations"]) {
-                        string country = affiliation["institution"]["country_code"];
-                        if (country != "US") continue;
-                        int64_t inst_id = extract_id(affiliation["institution"]["id"], "https://openalex.org/I");
-                        string display_name = affiliation["institution"]["display_name"];
-                        {
-                            // There's one single "Hematology\Oncology Clinic"
-                            // which is very annoying.
-                            auto off = display_name.find('\\');
-                            if (off != string::npos) {
-                                display_name[off] = ' ';
-                            }
+                    else if (authorship.contains("institutions")) {
+                        for (auto const &inst: authorship["institutions"]) {
+                            if (inst["country_code"].is_string()) countries.push_back(inst["country_code"]);
                         }
-                        auto &inst = institutions[inst_id];
-                        if (inst.display_name.empty()) {
-                            inst.id = inst_id;
-                            inst.display_name = display_name;
-                        }
-                        else {
-                            if (inst.display_name != display_name) {
-                                cout << "Institution name mismatch: " << inst.display_name << " vs " << display_name << endl;
-                            }
-                        }
-                        inst.authors[author_id] = std::make_pair(author_name, alternative_names);
+                    }
+                    for (auto const &country: countries) {
+                        spool.push({author_id, year, uint32_t(CountryLookup::get(country))});
                     }
                 }
-            }
-            catch (const json::exception& e) {
-                cerr << "JSON parsing error: " << e.what() << endl;
+            } catch (const json::exception& e) {
                 errors::bad_json += 1;
             }
         }
+        #pragma omp critical
+        {
+            ++done;
+            cout << format("Processed {}/{}", done, files.size()) << endl;
+        }
     }
-    fs::create_directories(outdir);
-    ofstream os(outdir + "/institutions.json");
-    json j = json::array();
-    for (auto const &[id, inst]: institutions) {
-        json inst_json;
-        inst_json["id"] = std::to_string(id);
-        inst_json["display_name"] = inst.display_name;
-        inst_json["authors"] = json::array();
-        
-        for (auto const &[author_id, name_and_alternatives]: inst.authors) {
-            json author;
-            author["id"] = std::to_string(author_id);
-            author["display_name"] = name_and_alternatives.first;
-            author["display_name_alternatives"] = name_and_alternatives.second;
-            inst_json["authors"].push_back(author);
+    cout << format("Parsed {} works, {} author years", parsed.load(), spool.size()) << endl;
+
+    // written to work_years.tmp and renamed into place when complete, so
+    // that readers never see a mix of old and new columns
+    string final_dir = outdir + "/work_years";
+    string dir = final_dir + ".tmp";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    uint64_t size = timings.size();
+    json meta;
+    meta["size"] = size;
+    meta["columns"] = {{{"name", "author_id"}, {"dtype", npy_descr<int64_t>()}},
+                       {{"name", "outflow_year"}, {"dtype", npy_descr<int32_t>()}},
+                       {{"name", "outflow_country"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "outflow_year_works"}, {"dtype", npy_descr<int32_t>()}},
+                       {{"name", "outflow_country_works"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "inflow_year"}, {"dtype", npy_descr<int32_t>()}},
+                       {{"name", "inflow_country"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "inflow_year_works"}, {"dtype", npy_descr<int32_t>()}},
+                       {{"name", "inflow_country_works"}, {"dtype", npy_descr<uint8_t>()}},
+                       {{"name", "year_masks"}, {"dtype", npy_descr<uint32_t>()}, {"shape", {size, TOTAL_YEARS}}}};
+    meta["year_begin"] = YEAR_BEGIN;
+    meta["year_end"] = YEAR_END;
+    meta["countries"] = vector<string>(COUNTRY_CODES, COUNTRY_CODES + NUM_COUNTRIES);
+    Sampler::describe(&meta);
+    NpyColumnWriter<int64_t> author_id(dir + "/author_id.npy", size);
+    NpyColumnWriter<int32_t> outflow_year(dir + "/outflow_year.npy", size);
+    NpyColumnWriter<uint8_t> outflow_country(dir + "/outflow_country.npy", size);
+    NpyColumnWriter<int32_t> outflow_year_works(dir + "/outflow_year_works.npy", size);
+    NpyColumnWriter<uint8_t> outflow_country_works(dir + "/outflow_country_works.npy", size);
+    NpyColumnWriter<int32_t> inflow_year(dir + "/inflow_year.npy", size);
+    NpyColumnWriter<uint8_t> inflow_country(dir + "/inflow_country.npy", size);
+    NpyColumnWriter<int32_t> inflow_year_works(dir + "/inflow_year_works.npy", size);
+    NpyColumnWriter<uint8_t> inflow_country_works(dir + "/inflow_country_works.npy", size);
+    // flat, reshape to (size, TOTAL_YEARS)
+    NpyColumnWriter<uint32_t> year_masks(dir + "/year_masks.npy", size * TOTAL_YEARS);
+    // -1 and country 0 when there is no migration
+    auto year_of = [](Migration const &mig) { return mig.country_id == 0 ? -1 : mig.year_offset + YEAR_BEGIN; };
+    size_t next = 0;
+    int64_t current = INVALID_ID;
+    YearMask mask;
+    // the spool is sorted by author, so the timings are walked alongside
+    auto emit = [&](int64_t until) {
+        while (next < timings.size() && timings[next].author_id <= until) {
+            auto const &t = timings[next];
+            YearMask none;
+            YearMask const &works = t.author_id == current ? mask : none;
+            Migration outflow = works.get_migration_outflow();
+            Migration inflow = works.get_migration_inflow();
+            author_id.push(t.author_id);
+            outflow_year.push(year_of(t.outflow));
+            outflow_country.push(t.outflow.country_id);
+            outflow_year_works.push(year_of(outflow));
+            outflow_country_works.push(outflow.country_id);
+            inflow_year.push(year_of(t.inflow));
+            inflow_country.push(t.inflow.country_id);
+            inflow_year_works.push(year_of(inflow));
+            inflow_country_works.push(inflow.country_id);
+            for (int y = 0; y < TOTAL_YEARS; ++y) year_masks.push(works.mask(y));
+            ++next;
+        }
+    };
+    spool.merge([&](WorkYear const &w) {
+        if (w.author_id != current) {
+            emit(w.author_id - 1);
+            current = w.author_id;
+            mask = YearMask();
+        }
+        mask.add(w.year, w.country_id);
+    });
+    emit(std::numeric_limits<int64_t>::max());
+    author_id.close();
+    outflow_year.close();
+    outflow_country.close();
+    outflow_year_works.close();
+    outflow_country_works.close();
+    inflow_year.close();
+    inflow_country.close();
+    inflow_year_works.close();
+    inflow_country_works.close();
+    year_masks.close();
+    {
+        ofstream os(dir + "/meta.json");
+        os << meta.dump(2) << endl;
+        if (!os) {
+            cerr << "Failed to write " << dir << "/meta.json" << endl;
+            throw 0;
+        }
+    }
+    fs::remove_all(final_dir);
+    fs::rename(dir, final_dir);
+    cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+}
+
+// Parse a whole string as an int; false if it is not one.
+bool parse_int (string const &text, int *value) {
+    try {
+        size_t end;
+        *value = std::stoi(text, &end);
+        return end == text.size();
+    } catch (std::logic_error const &) {    // invalid_argument, out_of_range
+        return false;
+    }
+}
+
+// Parse a whole string as a double; false if it is not one.
+bool parse_double (string const &text, double *value) {
+    try {
+        size_t end;
+        *value = std::stod(text, &end);
+        return end == text.size();
+    } catch (std::logic_error const &) {    // invalid_argument, out_of_range
+        return false;
+    }
+}
+
+// Remove "--name value" options from argv so that the positional
+// arguments of the subcommands keep their indices.
+void parse_options (int *argc, char **argv) {
+    int out = 1;
+    for (int i = 1; i < *argc; ++i) {
+        string opt = argv[i];
+        if (!opt.starts_with("--")) {
+            argv[out++] = argv[i];
+        }
+        else if (opt == "--compress_level" && i + 1 < *argc) {
+            string value = argv[++i];
+            if (!parse_int(value, &options::compress_level) || options::compress_level < -1 || options::compress_level > 9) {
+                cerr << "Invalid compression level: " << value << endl;
+                cerr << "  --compress_level N    gzip level of filter outputs, -1 to 9 (default 6)" << endl;
+                std::exit(1);
+            }
+        }
+        else if (opt == "--compress_threads" && i + 1 < *argc) {
+            string value = argv[++i];
+            if (!parse_int(value, &options::compress_threads) || options::compress_threads < 0) {
+                cerr << "Invalid number of compression threads: " << value << endl;
+                cerr << "  --compress_threads N  threads compressing filter outputs (N >= 0, 0 = all cores)" << endl;
+                std::exit(1);
+            }
+        }
+        else if (opt == "--shard" && i + 1 < *argc) {
+            string shard = argv[++i];
+            size_t slash = shard.find('/');
+            if (slash != string::npos) {
+                options::shard_index = std::stoi(shard.substr(0, slash));
+                options::shard_count = std::stoi(shard.substr(slash + 1));
+            }
+            if (slash == string::npos || options::shard_count < 1
+                    || options::shard_index < 0 || options::shard_index >= options::shard_count) {
+                cerr << "Invalid shard: " << shard << endl;
+                std::exit(1);
+            }
+        }
+        else if (opt == "--resume") {
+            options::resume = true;
+        }
+        else if (opt == "--memory_budget" && i + 1 < *argc) {
+            string value = argv[++i];
+            int budget;
+            if (!parse_int(value, &budget) || budget <= 0) {
+                cerr << "Invalid memory budget: " << value << endl;
+                cerr << "  --memory_budget MB  spill institution maps and sort buffers to disk beyond MB megabytes (MB >= 1)" << endl;
+                std::exit(1);
+            }
+            options::memory_budget = budget;
+        }
+        else if (opt == "--compact") {
+            options::compact = true;
+        }
+        else if (opt == "--gzip") {
+            options::gzip = true;
+        }
+        else if (opt == "--dedup") {
+            options::dedup = true;
+        }
+        else if (opt == "--slim") {
+            options::slim = true;
+        }
+        else if (opt == "--sparse") {
+            options::sparse = true;
+        }
+        else if (opt == "--csv") {
+            options::csv = true;
+        }
+        else if (opt == "--sample" && i + 1 < *argc) {
+            string value = argv[++i];
+            double rate;
+            if (!parse_double(value, &rate) || !(rate > 0 && rate <= 1)) {
+                cerr << "Invalid sample rate: " << value << endl;
+                std::exit(1);
+            }
+            Sampler::set_rate(rate);
+        }
+        else if (opt == "--snapshot" && i + 1 < *argc) {
+            string value = argv[++i];
+            if (!parse_int(value, &options::snapshot) || options::snapshot < 0) {
+                cerr << "Invalid snapshot interval: " << value << endl;
+                cerr << "  --snapshot S     publish partial counts to <out_dir>/snapshot every S seconds (S >= 0, 0 = off)" << endl;
+                std::exit(1);
+            }
+        }
+        else if (opt == "--bootstrap" && i + 1 < *argc) {
+            string value = argv[++i];
+            if (!parse_int(value, &options::bootstrap) || options::bootstrap < 0 || options::bootstrap > BOOTSTRAP_MAX) {
+                cerr << "Invalid number of bootstrap replicates: " << value << endl;
+                cerr << format("  --bootstrap B    also write 95% Poisson bootstrap bands from B replicates (0 to {})", BOOTSTRAP_MAX) << endl;
+                std::exit(1);
+            }
+        }
+        else {
+            cerr << "Unknown option: " << opt << endl;
+            std::exit(1);
         }
-        j.push_back(inst_json);
     }
-    os << j.dump(2) << endl;
+    *argc = out;
 }
 
 int main (int argc, char **argv) {
+    parse_options(&argc, argv);
     if (argc <= 1) {
-        cerr << "Usage: " << argv[0] <<  " [test | filter | count]" << endl;
+        cerr << "Usage: " << argv[0] <<  " [options] [test | filter | count | count_filtered | update | merge | id_set | work_years | transitions | institution_flows | scan | list_outflow | list_all | densify]" << endl;
+        cerr << "Options:" << endl;
+        cerr << "  --bootstrap B    also write 95% Poisson bootstrap bands from B replicates" << endl;
+        cerr << "  --snapshot S     publish partial counts to <out_dir>/snapshot every S seconds" << endl;
+        cerr << "  --sample RATE    keep only authors whose ID hashes below RATE, counts are scaled" << endl;
+        cerr << "  --csv            also export per-author records as CSV (outflow.txt)" << endl;
+        cerr << "  --sparse         save count tensors as compressed sparse counts.spt" << endl;
+        cerr << "  --slim           filter writes only the fields used downstream" << endl;
+        cerr << "  --shard i/N      process every N-th input file from i; count writes a partial for merge" << endl;
+        cerr << "  --resume         count reuses the checkpoints of input files finished by an interrupted run" << endl;
+        cerr << "  --dedup          read an author only from its latest updated_date= partition" << endl;
+        cerr << "  --compact        list_all / list_outflow write institutions.json without indentation" << endl;
+        cerr << "  --gzip           list_all / list_outflow write institutions.json.gz" << endl;
+        cerr << "  --memory_budget MB  spill institution maps and sort buffers to disk beyond MB megabytes" << endl;
+        cerr << "  --compress_level N    gzip level of filter outputs (default 6)" << endl;
+        cerr << "  --compress_threads N  threads compressing filter outputs (default all cores)" << endl;
     }
     else if (strcmp(argv[1], "test") == 0) {
         if (argc < 3) {
@@ -795,20 +4458,95 @@ int main (int argc, char **argv) {
     else if (strcmp(argv[1], "filter") == 0) {
         filter_relevant("data/authors");
     }
+    else if (strcmp(argv[1], "scan") == 0) {
+        // several stages over data/authors in one pass
+        vector<std::unique_ptr<ScanConsumer>> consumers;
+        std::set<string> seen;
+        for (int i = 2; i < argc; ++i) {
+            // a stage given twice would write the same outputs twice
+            if (!seen.insert(argv[i]).second) {
+                cerr << "Repeated stage: " << argv[i] << endl;
+                consumers.clear();
+                break;
+            }
+            if (strcmp(argv[i], "filter") == 0) {
+                consumers.emplace_back(new FilterConsumer("data/authors"));
+            }
+            else if (strcmp(argv[i], "list_all") == 0) {
+                consumers.emplace_back(new InstitutionConsumer("data/list_all"));
+            }
+            else if (strcmp(argv[i], "transitions") == 0 && i + 1 < argc) {
+                consumers.emplace_back(new TransitionConsumer(argv[++i]));
+            }
+            else {
+                cerr << "Unknown stage: " << argv[i] << endl;
+                consumers.clear();
+                break;
+            }
+        }
+        if (consumers.empty()) {
+            cerr << "Usage: " << argv[0] << " scan [filter] [list_all] [transitions <out_dir>]" << endl;
+            return 1;
+        }
+        vector<ScanConsumer *> stages;
+        for (auto &consumer: consumers) stages.push_back(consumer.get());
+        scan_authors("data/authors", stages);
+    }
     else if (strcmp(argv[1], "list_outflow") == 0) {
         list_institutions("data/filtered_outflow", "data/list_outflow");
     }
     else if (strcmp(argv[1], "list_all") == 0) {
         list_institutions("data/authors", "data/list_all");
     }
+    else if (strcmp(argv[1], "transitions") == 0) {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " transitions <out_dir>" << endl;
+        }
+        else {
+            count_transitions("data/authors", argv[2]);
+        }
+    }
+    else if (strcmp(argv[1], "institution_flows") == 0) {
+        int top_k = 100;
+        if (argc < 3 || (argc > 3 && (!parse_int(argv[3], &top_k) || top_k < 1))) {
+            cerr << "Usage: " << argv[0] << " institution_flows <out_dir> [top_k=100]" << endl;
+            return 1;
+        }
+        count_institution_flows(argv[2], top_k);
+    }
     else if (strcmp(argv[1], "count") == 0) {
         if (argc < 3) {
             cerr << "Usage: " << argv[0] << " test <out_dir>" << endl;
         }
         else {
-            std::unordered_set<int64_t> filter;
-            count_migration_inflow("data/filtered_inflow", argv[2]);
-            count_migration_outflow("data/filtered_outflow", argv[2], filter);
+            // the final outputs are skipped if neither the filtered files
+            // nor the count rules and options changed since they were made
+            json fingerprint = {{"rules", COUNT_RULES}, {"sample", options::sample}, {"bootstrap", options::bootstrap},
+                                {"csv", options::csv}, {"sparse", options::sparse}};
+            json entries = json::array();
+            for (char const *dir: {"data/filtered_inflow", "data/filtered_outflow"}) {
+                for (auto const &path: list_files(dir)) {
+                    entries.push_back(file_identity(path));
+                }
+            }
+            string manifest_path = format("{}/manifest.json", argv[2]);
+            if (options::shard_count == 1 && manifest_current(manifest_path, make_manifest(fingerprint, entries))) {
+                cout << "Outputs in " << argv[2] << " are up to date" << endl;
+                return 0;
+            }
+            fs::remove(manifest_path);
+            AuthorIdSet filter;
+            CountResult result(argv[2]);
+            count_migration_inflow("data/filtered_inflow", argv[2], &result);
+            count_migration_outflow("data/filtered_outflow", argv[2], filter, &result);
+            if (options::shard_count > 1) {
+                result.write_partial(format("{}/partial-{}-of-{}.bin", argv[2], options::shard_index, options::shard_count));
+            }
+            else {
+                result.save(argv[2]);
+                write_manifest(manifest_path, fingerprint, entries);
+            }
+            clear_checkpoints(argv[2], {"inflow", "outflow"});
             /*
             ofstream os("data/missing_country_stats.txt");
             vector<std::pair<string, int>> sorted;
@@ -823,25 +4561,89 @@ int main (int argc, char **argv) {
             */
         }
     }
+    else if (strcmp(argv[1], "densify") == 0) {
+        if (argc < 4) {
+            cerr << "Usage: " << argv[0] << " densify <in.spt> <out.npy> [index of leading dims...]" << endl;
+        }
+        else {
+            SparseTensor tensor(argv[2]);
+            vector<size_t> lo(tensor.shape.size(), 0);
+            vector<size_t> hi = tensor.shape;
+            for (int i = 4; i < argc; ++i) {
+                lo[i - 4] = std::stoull(argv[i]);
+                hi[i - 4] = lo[i - 4] + 1;
+            }
+            if (tensor.dtype == "<f8") xt::dump_npy(argv[3], tensor.densify<double>(lo, hi));
+            else xt::dump_npy(argv[3], tensor.densify<int>(lo, hi));
+        }
+    }
     else if (strcmp(argv[1], "count_filtered") == 0) {
         if (argc < 4) {
-            cerr << "Usage: " << argv[0] << " count_filtered <out_dir> <filter>" << endl;
+            cerr << "Usage: " << argv[0] << " count_filtered <out_dir> <filter_csv | records_dir | id_set>" << endl;
         }
         else {
-            std::unordered_set<int64_t> filter;
-            string filter_file = argv[3];
-            ifstream is(filter_file);
-            string line;
-            // Skip header
-            getline(is, line);
-            while (getline(is, line)) {
-                size_t pos = line.find(',');
-                if (pos != string::npos) {
-                    int64_t id = stoll(line.substr(0, pos));
-                    filter.insert(id);
+            AuthorIdSet filter = AuthorIdSet::load(argv[3]);
+            cout << format("Loaded {} author IDs in {} containers", filter.size(), filter.container_count()) << endl;
+            CountResult result(argv[2]);
+            count_migration_outflow("data/filtered_outflow", argv[2], filter, &result);
+            if (options::shard_count > 1) {
+                result.write_partial(format("{}/partial-{}-of-{}.bin", argv[2], options::shard_index, options::shard_count));
+            }
+            else {
+                result.save(argv[2]);
+            }
+            clear_checkpoints(argv[2], {"outflow_filtered"});
+        }
+    }
+    else if (strcmp(argv[1], "work_years") == 0) {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " work_years <out_dir> [<works_dir>]" << endl;
+        }
+        else {
+            count_work_years(argc > 3 ? argv[3] : "data/works", argv[2]);
+        }
+    }
+    else if (strcmp(argv[1], "id_set") == 0) {
+        if (argc < 4) {
+            cerr << "Usage: " << argv[0] << " id_set <filter_csv | records_dir> <out_file>" << endl;
+        }
+        else {
+            AuthorIdSet set = AuthorIdSet::load(argv[2]);
+            set.save(argv[3]);
+            cout << format("Saved {} author IDs in {} containers", set.size(), set.container_count()) << endl;
+        }
+    }
+    else if (strcmp(argv[1], "update") == 0) {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " update <out_dir> [<authors_dir>]" << endl;
+        }
+        else {
+            update_counts(argc > 3 ? argv[3] : "data/authors", argv[2]);
+        }
+    }
+    else if (strcmp(argv[1], "merge") == 0) {
+        if (argc < 4) {
+            cerr << "Usage: " << argv[0] << " merge <out_dir> <partial> [<partial> ...]" << endl;
+        }
+        else {
+            fs::create_directories(argv[2]);
+            if (is_stock_partial(argv[3])) {
+                // partials of a sharded filter, e.g. merge data/stock data/stock_partial-*
+                Survey stock(SURVEY_STOCK);
+                for (int i = 3; i < argc; ++i) {
+                    read_stock_partial(argv[i], i - 3, &stock);
+                    cout << format("Merged {}", argv[i]) << endl;
                 }
+                stock.save(argv[2]);
+                return 0;
+            }
+            CountResult result(argv[2]);
+            for (int i = 3; i < argc; ++i) {
+                result.read_partial(argv[i]);
+                cout << format("Merged {}", argv[i]) << endl;
             }
-            count_migration_outflow("data/filtered_outflow", argv[2], filter);
+            cerr << format("Errors: {} bad JSON, {} invalid IDs", errors::bad_json.load(), errors::invalid_id.load()) << endl;
+            result.save(argv[2]);
         }
     }
     return 0;
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# Reader of the sparse count tensors (counts.spt) written by
+# run_all_countries --sparse.  See dump_sparse in run_all_countries.cpp
+# for the layout.
+import sys
+import json
+import mmap
+import zlib
+import numpy as np
+
+MAGIC = b'AASPARSE'
+
+class SparseTensor:
+    def __init__ (self, path):
+        with open(path, 'rb') as f:
+            self.buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        assert self.buf[:8] == MAGIC, f'not a sparse tensor file: {path}'
+        hlen = int(np.frombuffer(self.buf, dtype='<u8', count=1, offset=8)[0])
+        self.header = json.loads(self.buf[16:16 + hlen])
+        self.body = 16 + hlen
+        self.shape = tuple(self.header['shape'])
+        self.dtype = np.dtype(self.header['dtype'])
+
+    def __getitem__ (self, index):
+        # index: ints and step-1 slices over the leading dimensions
+        if not isinstance(index, tuple):
+            index = (index,)
+        lo, hi, squeeze = [], [], []
+        for d, n in enumerate(self.shape):
+            i = index[d] if d < len(index) else slice(None)
+            if isinstance(i, slice):
+                b, e, step = i.indices(n)
+                assert step == 1, 'only step 1 slices are supported'
+            else:
+                b, e = i, i + 1
+                squeeze.append(d)
+            lo.append(b)
+            hi.append(e)
+        lo = np.array(lo)
+        hi = np.array(hi)
+        first = np.ravel_multi_index(lo, self.shape)
+        last = np.ravel_multi_index(hi - 1, self.shape)
+        out = np.zeros(hi - lo, dtype=self.dtype)
+        for chunk in self.header['chunks']:
+            if chunk['last'] < first or chunk['first'] > last:
+                continue
+            n = chunk['nnz']
+            begin = self.body + chunk['offset']
+            raw = zlib.decompress(self.buf[begin:begin + chunk['bytes']])
+            lin = np.cumsum(np.frombuffer(raw, dtype='<i8', count=n))
+            val = np.frombuffer(raw, dtype=self.dtype, count=n, offset=8 * n)
+            keep = (lin >= first) & (lin <= last)
+            idx = np.array(np.unravel_index(lin[keep], self.shape))
+            inside = np.all((idx >= lo[:, None]) & (idx < hi[:, None]), axis=0)
+            out[tuple(idx[:, inside] - lo[:, None])] = val[keep][inside]
+        return out.squeeze(axis=tuple(squeeze)) if squeeze else out
+
+    def todense (self):
+        return self[()]
+
+def load_counts (root, name='counts'):
+    # dense counts of a survey directory, whichever format it was saved in
+    import os
+    path = os.path.join(root, name + '.npy')
+    if os.path.exists(path):
+        return np.load(path)
+    return SparseTensor(os.path.join(root, name + '.spt')).todense()
+
+if __name__ == '__main__':
+    t = SparseTensor(sys.argv[1])
+    print(t.shape, t.dtype, t.header['nnz'], 'nonzeros', len(t.header['chunks']), 'chunks')